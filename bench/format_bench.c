@@ -0,0 +1,142 @@
+/*
+ * Microbenchmark for the -l number formatting: format_size_human() and
+ * format_uint() against the snprintf() versions they replaced. Every value
+ * is checked against snprintf() before anything is timed.
+ *
+ *   gcc -O2 -pthread -o format_bench bench/format_bench.c && ./format_bench
+ *
+ * The samples cover the whole u64 range: every bit length, plus the values
+ * around each unit boundary and the .x5 rounding ties.
+ */
+#define main ls_main
+#include "../main.c"
+#undef main
+
+#define SAMPLES (1 << 20)
+#define ROUNDS 20
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+
+static uint64_t next_random(void) {
+  // xorshift64*
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 0x2545F4914F6CDD1Dull;
+}
+
+/* the old format_size_human(), kept as the reference */
+static size_t reference_human(long long size, char * buffer, size_t buf_size) {
+  const char * units[] = {
+    "B", "K", "M", "G", "T", "P", "E"
+  };
+  int unit_index = 0;
+  double human_size = size;
+
+  while (human_size >= 1024 && unit_index < 6) {
+    human_size /= 1024;
+    unit_index++;
+  }
+
+  if (unit_index == 0) {
+    return (size_t) snprintf(buffer, buf_size, "%lld", size);
+  }
+  return (size_t) snprintf(buffer, buf_size, "%.1f%s", human_size, units[unit_index]);
+}
+
+static double seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, & ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void) {
+  uint64_t * values = xrealloc(NULL, SAMPLES * sizeof( * values));
+  size_t count = 0;
+
+  // quarter steps of every unit, up past the next one: odd quarters are the
+  // exact .x5 ties that "%.1f" rounds to even
+  for (int unit = 0; unit <= 6; unit++) {
+    uint64_t scale = 1ull << (10 * unit);
+    for (uint64_t k = 0; k < 4 * 2048; k++) {
+      unsigned __int128 v = (unsigned __int128) k * scale / 4;
+      if (v <= INT64_MAX) {
+        values[count++] = (uint64_t) v;
+      }
+    }
+  }
+  // uniform over bit lengths, so every magnitude gets the same share
+  while (count < SAMPLES) {
+    int bits = (int)(next_random() % 64);
+    values[count++] = next_random() >> (63 - bits);
+  }
+
+  // sizes come from statx() as u64 but are formatted as long long
+  char got[32], want[32];
+  for (size_t index = 0; index < count; index++) {
+    long long size = (long long)(values[index] & INT64_MAX);
+    size_t got_len = format_size_human(size, got);
+    size_t want_len = reference_human(size, want, sizeof(want));
+    if (got_len != want_len || memcmp(got, want, want_len) != 0) {
+      fprintf(stderr, "-h mismatch for %lld: got %s, want %s\n", size, got, want);
+      return 1;
+    }
+
+    char digits[20];
+    char * p = format_uint(values[index], digits + sizeof(digits));
+    want_len = (size_t) snprintf(want, sizeof(want), "%llu",
+      (unsigned long long) values[index]);
+    if ((size_t)(digits + sizeof(digits) - p) != want_len ||
+      memcmp(p, want, want_len) != 0) {
+      fprintf(stderr, "decimal mismatch for %s\n", want);
+      return 1;
+    }
+  }
+  printf("%zu values match snprintf()\n", count);
+
+  volatile size_t sink = 0;
+  double start, elapsed[4];
+
+  start = seconds();
+  for (int round = 0; round < ROUNDS; round++) {
+    for (size_t index = 0; index < count; index++) {
+      sink += reference_human((long long)(values[index] & INT64_MAX), want, sizeof(want));
+    }
+  }
+  elapsed[0] = seconds() - start;
+
+  start = seconds();
+  for (int round = 0; round < ROUNDS; round++) {
+    for (size_t index = 0; index < count; index++) {
+      sink += format_size_human((long long)(values[index] & INT64_MAX), got);
+    }
+  }
+  elapsed[1] = seconds() - start;
+
+  start = seconds();
+  for (int round = 0; round < ROUNDS; round++) {
+    for (size_t index = 0; index < count; index++) {
+      sink += (size_t) snprintf(want, sizeof(want), "%8lld", (long long) values[index]);
+    }
+  }
+  elapsed[2] = seconds() - start;
+
+  start = seconds();
+  for (int round = 0; round < ROUNDS; round++) {
+    for (size_t index = 0; index < count; index++) {
+      char digits[20];
+      sink += (size_t)(digits + sizeof(digits) -
+        format_uint(values[index], digits + sizeof(digits)));
+    }
+  }
+  elapsed[3] = seconds() - start;
+
+  double calls = (double) count * ROUNDS;
+  printf("-h   snprintf %6.1f ns  fixed-point %6.1f ns  (%.1fx)\n",
+    elapsed[0] / calls * 1e9, elapsed[1] / calls * 1e9, elapsed[0] / elapsed[1]);
+  printf("size snprintf %6.1f ns  format_uint %6.1f ns  (%.1fx)\n",
+    elapsed[2] / calls * 1e9, elapsed[3] / calls * 1e9, elapsed[2] / elapsed[3]);
+
+  free(values);
+  return 0;
+}
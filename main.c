@@ -1,36 +1,197 @@
+#define _GNU_SOURCE // for statx() and getdents64
+
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <grp.h>
+#include <linux/io_uring.h>
+#include <linux/magic.h>
+#include <limits.h>
+#include <locale.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
-static int err_code;
-static int file_count = 0;
+/*
+ * struct entry: what we know about one file being listed. `stx` is filled in
+ * at most once (see stat_entry()); formatting and the recursion check both
+ * read from here instead of going back to the filesystem.
+ */
+struct entry {
+  char * name; // just the name "component"
+  unsigned char d_type; // DT_* type, DT_UNKNOWN until known
+  bool have_stat; // whether stx holds valid data
+  int stat_errno; // a batched lookup failed; reported once the entry is listed
+  struct statx stx;
+};
+
+// Updated from every -j worker, hence atomic.
+static atomic_int err_code;
+static atomic_int file_count = 0;
 static bool count_only = false;
 static bool human_readable = false;
 
+// Listing order within a directory: by name unless -t, -S, -X or -U says
+// otherwise; -r reverses it, and --group-directories-first puts
+// subdirectories ahead of everything else either way.
+enum sort_order {
+  SORT_NAME,
+  SORT_NONE, // -U: directory order
+  SORT_TIME, // -t: newest first
+  SORT_SIZE, // -S: largest first
+  SORT_EXTENSION, // -X: by what follows the last '.'
+  SORT_VERSION // -v: digit runs compared as numbers
+};
+static int sort_by = SORT_NAME;
+static bool sort_reverse = false;
+static bool dirs_first = false;
+
+// --stream: list every entry as it is read, holding on to nothing (see
+// list_dir_stream())
+static bool stream = false;
+
+// --limit: list only the first this many entries of each directory (0: all)
+static size_t list_limit = 0;
+
+// --memory-limit: roughly how much a sorted listing may keep in memory per
+// directory before it sorts in runs on disk instead (0: no limit)
+static size_t memory_limit = 0;
+
+// whether --limit keeps a heap of the first rows (sorted listings) rather
+// than stopping the directory read early
+static bool limit_heap(void) {
+  return list_limit != 0 && sort_by != SORT_NONE;
+}
+
+// Names are ordered by LC_COLLATE; in the C/POSIX locale that is plain byte
+// order and no collation keys are needed. Set up once in main(). -v orders
+// by version keys instead (see add_version_key()).
+static bool use_collation = false;
+
+// Number of threads for -R (-j N), and how much finished output they may
+// buffer ahead of the sequencer (--reorder-buffer).
+static int jobs = 1;
+static size_t reorder_buffer_size = 64 * 1024 * 1024;
+
+/*
+ * struct outbuf: listing output, formatted by hand (see the out_*() helpers)
+ * into one buffer that goes out with a single write() whenever it fills up.
+ * stdout_buf is the real thing; with -j each directory block is rendered into
+ * an outbuf of its own with fd -1, which only grows and is handed to the
+ * sequencer when the block is done. Error messages go through here too, so
+ * they stay in order with the listing around them.
+ */
+struct outbuf {
+  char * data;
+  size_t len;
+  size_t cap;
+  int fd; // where it is flushed to; -1 for a block buffer
+};
+
+// Bytes gathered per write() (--output-buffer). On a terminal stdout is also
+// flushed after every directory, so a long -R listing shows up as it goes.
+static size_t output_buffer_size = 64 * 1024;
+static bool flush_each_dir = false;
+
+static struct outbuf stdout_buf = {
+  .data = NULL, .len = 0, .cap = 0, .fd = STDOUT_FILENO
+};
+
+// Where listing output goes: stdout_buf, or with -j the buffer of the
+// directory block the current thread is rendering.
+static _Thread_local struct outbuf * output;
+
+// The statx() fields the active output columns need, and the flags to pass
+// along with them; both are set up once in main(). Asking for less lets
+// FUSE/network filesystems skip work, and AT_STATX_DONT_SYNC (--dont-sync)
+// lets them answer from cache instead of revalidating with the server.
+static unsigned int stat_mask = STATX_TYPE;
+static int stat_flags = AT_SYMLINK_NOFOLLOW;
+
+// Buffer handed to getdents64 (--dirent-buffer). A directory is always read
+// to the end before we descend into its children, so one buffer per thread
+// serves the whole traversal; it is allocated on first use.
+static _Thread_local char * dirent_buf = NULL;
+static size_t dirent_buf_size = 256 * 1024;
+
+// --io-uring: look up a whole getdents64 batch with IORING_OP_STATX, keeping
+// up to queue_depth (--queue-depth) lookups in flight per thread.
+static bool use_uring = false;
+static unsigned int queue_depth = 64;
+
+// --stat-threads: helper threads that look up big getdents64 batches.
+static size_t stat_threads = 0;
+
+// long-only options; getopt_long() hands these back instead of a flag char
+enum {
+  OPT_DONT_SYNC = 256,
+  OPT_DIRENT_BUFFER,
+  OPT_REORDER_BUFFER,
+  OPT_IO_URING,
+  OPT_QUEUE_DEPTH,
+  OPT_STAT_THREADS,
+  OPT_ID_SOURCE,
+  OPT_PASSWD_FILE,
+  OPT_GROUP_FILE,
+  OPT_OUTPUT_BUFFER,
+  OPT_DIRS_FIRST,
+  OPT_LIMIT,
+  OPT_MEMORY_LIMIT,
+  OPT_STREAM,
+};
+
+/*
+ * The record layout getdents64 fills the buffer with (see `man 2 getdents`).
+ * glibc doesn't export it, so it's spelled out here.
+ */
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+/*
+ * struct dir_reader: reads a directory with raw getdents64 calls into
+ * dirent_buf. Records are handed out in place, so an entry's name is only
+ * valid until the next refill.
+ */
+struct dir_reader {
+  int fd;
+  char * buf; // NULL: the thread's dirent_buf
+  size_t size; // of buf
+  size_t pos; // offset of the next record in the buffer
+  size_t len; // bytes of it filled by the last getdents64
+};
+
+
+struct dir_stack;
 
 void handle_error(char * fullname, char * action);
-bool test_file(char * pathandname);
-bool is_dir(char * pathandname);
-const char * ftype_to_str(mode_t mode);
-void list_file(char * pathandname, char * name, bool list_long);
+static void push_pending(struct dir_stack * stack, const char * name);
+void list_file(int dirfd, char * dirname, struct entry * e, bool list_long);
 void list_dir(char * dirname, bool list_long, bool list_all, bool recursive);
 
 #define NOT_YET_IMPLEMENTED(msg)\
-do {
+do {\
   \
-  printf("Not yet implemented: "
+  printf("Not yet implemented: "\
     msg "\n");\
   exit(255);\
 } while (0)
@@ -44,65 +205,488 @@ do {
  *     }
  */
 #define PRINT_ERROR(progname, what_happened, pathandname)\
-do {
+do {\
   \
-  printf("%s: %s %s: %s\n", progname, what_happened, pathandname, \
-    strerror(errno));\
+  const char * reason = strerror(errno);\
+  out_str(progname);\
+  out_str(": ");\
+  out_str(what_happened);\
+  out_char(' ');\
+  out_str(pathandname);\
+  out_str(": ");\
+  out_str(reason);\
+  out_char('\n');\
 } while (0)
 
-/* PRINT_PERM_CHAR:
- *
- * This will be useful for -l permission printing.  It prints the given
- * 'ch' if the permission exists, or "-" otherwise.
- * Example usage:
- *     PRINT_PERM_CHAR(sb.st_mode, S_IRUSR, "r");
+/*
+ * Mode strings for -l. mode_table holds the nine permission characters for
+ * every combination of the twelve permission bits, setuid/setgid/sticky
+ * included ("rwsr-sr-t"), behind a slot for the file type, which comes from
+ * ftype_chars. See init_mode_table() and format_mode().
+ */
+static char mode_table[4096][10];
+static const char ftype_chars[16] = {
+  [S_IFIFO >> 12] = 'p', [S_IFCHR >> 12] = 'c', [S_IFDIR >> 12] = 'd',
+  [S_IFBLK >> 12] = 'b', [S_IFREG >> 12] = '-', [S_IFLNK >> 12] = 'l',
+  [S_IFSOCK >> 12] = 's'
+};
+
+/* xrealloc(): realloc() that gives up on the whole listing if memory runs out. */
+static void * xrealloc(void * ptr, size_t size) {
+  ptr = realloc(ptr, size);
+  if (ptr == NULL) {
+    perror("ls");
+    exit(64);
+  }
+  return ptr;
+}
+
+/* write_all(): write() until all of `buf` is out; a failed write ends the run */
+static void write_all(int fd, const char * buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // _exit(): this also runs from the atexit() flush
+      perror("ls: write error");
+      _exit(64);
+    }
+    buf += n;
+    len -= (size_t) n;
+  }
+}
+
+static void out_flush(struct outbuf * o) {
+  write_all(o -> fd, o -> data, o -> len);
+  o -> len = 0;
+}
+
+static void flush_stdout(void) {
+  out_flush( & stdout_buf);
+}
+
+/*
+ * out_room(): make space for `n` more bytes in `o`, writing out what is
+ * there first if `o` is backed by an fd. Returns where they go.
+ */
+static char * out_room(struct outbuf * o, size_t n) {
+  if (o -> len + n > o -> cap) {
+    if (o -> fd != -1 && o -> len > 0) {
+      out_flush(o);
+    }
+    if (o -> len + n > o -> cap) {
+      size_t cap = o -> cap ? o -> cap * 2 : o -> fd != -1 ?
+        output_buffer_size : 4096;
+      while (cap < o -> len + n) {
+        cap *= 2;
+      }
+      o -> data = xrealloc(o -> data, cap);
+      o -> cap = cap;
+    }
+  }
+  return o -> data + o -> len;
+}
+
+static void out_mem(const void * p, size_t n) {
+  struct outbuf * o = output;
+  if (o -> fd != -1 && n >= output_buffer_size && o -> len + n > o -> cap) {
+    // bigger than the buffer itself (a finished -j block): skip the copy
+    out_flush(o);
+    write_all(o -> fd, p, n);
+    return;
+  }
+  memcpy(out_room(o, n), p, n);
+  o -> len += n;
+}
+
+static void out_str(const char * s) {
+  out_mem(s, strlen(s));
+}
+
+static void out_char(char c) {
+  * out_room(output, 1) = c;
+  output -> len++;
+}
+
+/*
+ * out_field(): `n` bytes of `s` padded with spaces to `width`, on the right
+ * like "%-*s" if `left` is set, otherwise on the left like "%*s".
  */
-#define PRINT_PERM_CHAR(mode, mask, ch) printf("%s", (mode & mask) ? ch : "-");
+static void out_field(const char * s, size_t n, size_t width, bool left) {
+  size_t pad = n < width ? width - n : 0;
+  char * p = out_room(output, n + pad);
+  if (!left) {
+    memset(p, ' ', pad);
+    p += pad;
+  }
+  memcpy(p, s, n);
+  if (left) {
+    memset(p + n, ' ', pad);
+  }
+  output -> len += n + pad;
+}
+
+/*
+ * format_uint(): write `v` in decimal so that it ends just before `end`, two
+ * digits per division, and return where it starts. 20 bytes always suffice.
+ */
+static char * format_uint(uint64_t v, char * end) {
+  static const char pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+  char * p = end;
+  while (v >= 100) {
+    const char * pair = pairs + 2 * (v % 100);
+    v /= 100;
+    * --p = pair[1];
+    * --p = pair[0];
+  }
+  if (v >= 10) {
+    * --p = pairs[2 * v + 1];
+    * --p = pairs[2 * v];
+  } else {
+    * --p = (char)('0' + v);
+  }
+  return p;
+}
+
+/* out_uint(): `v` in decimal, padded to `width` as out_field() does */
+static void out_uint(uint64_t v, size_t width, bool left) {
+  char digits[20];
+  char * p = format_uint(v, digits + sizeof(digits));
+  out_field(p, (size_t)(digits + sizeof(digits) - p), width, left);
+}
+
+/*
+ * out_dir_done(): a directory's output is complete. On a terminal, let it
+ * be seen now rather than when the buffer fills.
+ */
+static void out_dir_done(void) {
+  if (flush_each_dir && output -> fd != -1) {
+    out_flush(output);
+  }
+}
+
+/*
+ * Owner and group names for -l. A whole tree usually has a handful of owners,
+ * but with NSS backed by sssd/LDAP every getpwuid()/getgrgid() can be a round
+ * trip, so each id is looked up once and remembered, unknown ids included.
+ * The tables are shared by all -j workers behind id_lock (which also covers
+ * the static storage getpwuid()/getgrgid() return); every thread also keeps
+ * its last answer, since neighbouring files tend to share an owner.
+ */
+struct id_slot {
+  uint32_t id;
+  bool used;
+  char * name; // NULL: the id has no name
+};
+
+struct id_cache {
+  struct id_slot * slots;
+  size_t cap; // a power of two
+  size_t count;
+};
+
+static pthread_mutex_t id_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct id_cache uid_cache, gid_cache;
+
+static struct id_slot * id_cache_slot(struct id_cache * c, uint32_t id) {
+  size_t index = (id * 0x9E3779B1u) & (c -> cap - 1);
+  while (c -> slots[index].used && c -> slots[index].id != id) {
+    index = (index + 1) & (c -> cap - 1);
+  }
+  return & c -> slots[index];
+}
+
+static void id_cache_grow(struct id_cache * c) {
+  struct id_cache old = * c;
+  c -> cap = old.cap ? old.cap * 2 : 64;
+  c -> slots = calloc(c -> cap, sizeof( * c -> slots));
+  if (c -> slots == NULL) {
+    perror("ls");
+    exit(64);
+  }
+  for (size_t index = 0; index < old.cap; index++) {
+    if (old.slots[index].used) {
+      * id_cache_slot(c, old.slots[index].id) = old.slots[index];
+    }
+  }
+  free(old.slots);
+}
+
+/*
+ * id_cache_get(): the name cached for `id`, resolving it with `resolve`
+ * (called with id_lock held) the first time.
+ */
+static const char * id_cache_get(struct id_cache * c, uint32_t id,
+  const char * ( * resolve)(uint32_t)) {
+  pthread_mutex_lock( & id_lock);
+  if (2 * (c -> count + 1) > c -> cap) {
+    id_cache_grow(c);
+  }
+  struct id_slot * slot = id_cache_slot(c, id);
+  if (!slot -> used) {
+    const char * name = resolve(id);
+    slot -> id = id;
+    slot -> used = true;
+    slot -> name = name ? strdup(name) : NULL;
+    c -> count++;
+  }
+  const char * name = slot -> name;
+  pthread_mutex_unlock( & id_lock);
+  return name;
+}
+
+/*
+ * --id-source=files: instead of asking NSS, answer from /etc/passwd and
+ * /etc/group (or --passwd-file/--group-file, e.g. a container image's own),
+ * each mapped and indexed once at startup. The mapping is private, so names
+ * are NUL-terminated in place and the caches point straight into it; ids the
+ * files don't mention are simply unknown.
+ */
+static bool ids_from_files = false;
+static char * passwd_file = "/etc/passwd";
+static char * group_file = "/etc/group";
+
+/*
+ * load_id_file(): map `path` and enter the id of every "name:pw:id:..."
+ * line into `c`. The first line for an id wins, as with getpwuid().
+ */
+static void load_id_file(const char * path, struct id_cache * c) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat sb;
+  if (fd == -1 || fstat(fd, & sb) == -1) {
+    printf("ls: cannot read %s: %s\n", path, strerror(errno));
+    exit(64);
+  }
+  if (sb.st_size == 0) {
+    close(fd);
+    return;
+  }
+
+  char * map = mmap(NULL, (size_t) sb.st_size, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    printf("ls: cannot read %s: %s\n", path, strerror(errno));
+    exit(64);
+  }
+
+  char * end = map + sb.st_size;
+  for (char * line = map; line < end;) {
+    char * eol = memchr(line, '\n', (size_t)(end - line));
+    if (eol == NULL) {
+      eol = end;
+    }
+
+    // name, password, then the id
+    char * name_end = memchr(line, ':', (size_t)(eol - line));
+    char * pw_end = name_end ? memchr(name_end + 1, ':', (size_t)(eol - name_end - 1)) : NULL;
+    if (pw_end != NULL && name_end > line && line[0] != '#' && line[0] != '+' &&
+      line[0] != '-') {
+      uint64_t id = 0;
+      char * digit = pw_end + 1;
+      while (digit < eol && * digit >= '0' && * digit <= '9' && id <= UINT32_MAX) {
+        id = id * 10 + (uint64_t)( * digit++ - '0');
+      }
+      if (digit > pw_end + 1 && digit < eol && * digit == ':' && id <= UINT32_MAX) {
+        if (2 * (c -> count + 1) > c -> cap) {
+          id_cache_grow(c);
+        }
+        struct id_slot * slot = id_cache_slot(c, (uint32_t) id);
+        if (!slot -> used) {
+          * name_end = '\0';
+          * slot = (struct id_slot) {
+            .id = (uint32_t) id, .used = true, .name = line
+          };
+          c -> count++;
+        }
+      }
+    }
+    line = eol + 1;
+  }
+}
+
+static const char * passwd_name(uint32_t uid) {
+  if (ids_from_files) {
+    return NULL; // anything not in the file is unknown
+  }
+  struct passwd * p = getpwuid((uid_t) uid);
+  return p ? p -> pw_name : NULL;
+}
+
+static const char * group_name(uint32_t gid) {
+  if (ids_from_files) {
+    return NULL;
+  }
+  struct group * g = getgrgid((gid_t) gid);
+  return g ? g -> gr_name : NULL;
+}
 
 /*
- * Get username for uid. Return 1 on failure, 0 otherwise.
+ * Get username for uid. Returns NULL if it has none.
  */
-static int uname_for_uid(uid_t uid, char * buf, size_t buflen) {
-  struct passwd * p = getpwuid(uid);
-  if (p == NULL) {
-    return 1;
+static const char * uname_for_uid(uid_t uid) {
+  static _Thread_local bool valid = false;
+  static _Thread_local uid_t last;
+  static _Thread_local const char * last_name;
+
+  if (!valid || last != uid) {
+    last_name = id_cache_get( & uid_cache, (uint32_t) uid, passwd_name);
+    last = uid;
+    valid = true;
   }
-  strncpy(buf, p -> pw_name, buflen);
-  return 0;
+  return last_name;
 }
 
 /*
- * Get group name for gid. Return 1 on failure, 0 otherwise.
+ * Get group name for gid. Returns NULL if it has none.
  */
-static int group_for_gid(gid_t gid, char * buf, size_t buflen) {
-  struct group * g = getgrgid(gid);
-  if (g == NULL) {
-    return 1;
+static const char * group_for_gid(gid_t gid) {
+  static _Thread_local bool valid = false;
+  static _Thread_local gid_t last;
+  static _Thread_local const char * last_name;
+
+  if (!valid || last != gid) {
+    last_name = id_cache_get( & gid_cache, (uint32_t) gid, group_name);
+    last = gid;
+    valid = true;
   }
-  strncpy(buf, g -> gr_name, buflen);
-  return 0;
+  return last_name;
 }
 
+// "Now" for the date column, taken once in main() so every file in the run
+// is judged against the same instant.
+static time_t now_sec;
+
+/*
+ * Formatted dates, remembered per thread by the minute they fall in (and by
+ * which of the two formats they need). Files in a directory tend to share
+ * timestamps, so most -l lines get their date column from here without
+ * going near localtime_r() and its timezone lock. Zones whose UTC offset
+ * isn't whole minutes (local mean time before ~1900) are never cached, as a
+ * UTC minute wouldn't map onto a single local minute there.
+ */
+#define DATE_CACHE_SIZE 256
+
+struct date_slot {
+  int64_t key; // minute << 1 | recent; -1 when empty
+  size_t len;
+  char text[24];
+};
+
+static _Thread_local struct date_slot date_cache[DATE_CACHE_SIZE];
+static _Thread_local bool date_cache_ready = false;
+
 /*
- * Format the supplied `struct timespec` in `ts` (e.g., from `stat.st_mtime`) as a
+ * Format the supplied `struct timespec` in `ts` (e.g., from `statx.stx_mtime`) as a
  * string in `char *out`. Returns the length of the formatted string (see, `man
  * 3 strftime`).
  */
 static size_t date_string(struct timespec * ts, char * out, size_t len) {
-  struct timespec now;
-  timespec_get( & now, TIME_UTC);
-  struct tm * t = localtime( & ts -> tv_sec);
-  if (now.tv_sec < ts -> tv_sec) {
-    // Future time, treat with care.
-    return strftime(out, len, "%b %e %Y", t);
-  } else {
-    time_t difference = now.tv_sec - ts -> tv_sec;
-    if (difference < 31556952 ull) {
-      return strftime(out, len, "%b %e %H:%M", t);
-    } else {
-      return strftime(out, len, "%b %e %Y", t);
+  // Future times, and anything older than a year, get the year instead of
+  // the time of day.
+  bool recent = now_sec >= ts -> tv_sec && now_sec - ts -> tv_sec < 31556952ll;
+
+  if (!date_cache_ready) {
+    for (size_t index = 0; index < DATE_CACHE_SIZE; index++) {
+      date_cache[index].key = -1;
+    }
+    date_cache_ready = true;
+  }
+
+  int64_t minute = ts -> tv_sec >= 0 ? ts -> tv_sec / 60 : (ts -> tv_sec - 59) / 60;
+  int64_t key = minute >= 0 ? (minute << 1) | recent : -1;
+  struct date_slot * slot = & date_cache[(uint64_t)(minute ^ (minute >> 8)) % DATE_CACHE_SIZE];
+  if (key != -1 && slot -> key == key && slot -> len < len) {
+    memcpy(out, slot -> text, slot -> len + 1);
+    return slot -> len;
+  }
+
+  struct tm tm;
+  struct tm * t = localtime_r( & ts -> tv_sec, & tm);
+  if (t == NULL) {
+    return (size_t) snprintf(out, len, "%lld", (long long) ts -> tv_sec);
+  }
+  size_t n = strftime(out, len, recent ? "%b %e %H:%M" : "%b %e %Y", t);
+
+  if (key != -1 && t -> tm_gmtoff % 60 == 0 && n < sizeof(slot -> text)) {
+    slot -> key = key;
+    slot -> len = n;
+    memcpy(slot -> text, out, n + 1);
+  }
+  return n;
+}
+
+/*
+ * dir_reader_next(): return the next record of the directory, refilling
+ * dirent_buf with one getdents64 call when it runs dry. Returns NULL at the
+ * end of the directory, or on error with errno set (errno is 0 at the end).
+ */
+static struct linux_dirent64 * dir_reader_next(struct dir_reader * r) {
+  if (r -> buf == NULL) {
+    if (dirent_buf == NULL) {
+      dirent_buf = xrealloc(NULL, dirent_buf_size);
+    }
+    r -> buf = dirent_buf;
+    r -> size = dirent_buf_size;
+  }
+  if (r -> pos >= r -> len) {
+    long n = syscall(SYS_getdents64, r -> fd, r -> buf, r -> size);
+    if (n <= 0) {
+      if (n == 0) {
+        errno = 0;
+      }
+      return NULL;
     }
+    r -> pos = 0;
+    r -> len = (size_t) n;
+  }
+
+  struct linux_dirent64 * rec = (struct linux_dirent64 * )(r -> buf + r -> pos);
+  r -> pos += rec -> d_reclen;
+  return rec;
+}
+
+/*
+ * parse_size(): parse a byte count such as "65536", "64K" or "1M" (binary
+ * units). Returns false if `arg` isn't one.
+ */
+static bool parse_size(const char * arg, size_t * out) {
+  char * end;
+  errno = 0;
+  unsigned long long n = strtoull(arg, & end, 10);
+  if (errno != 0 || end == arg || n == 0) {
+    return false;
+  }
+
+  int shift = 0;
+  switch ( * end) {
+  case 'K':
+  case 'k':
+    shift = 10;
+    end++;
+    break;
+  case 'M':
+  case 'm':
+    shift = 20;
+    end++;
+    break;
+  case 'G':
+  case 'g':
+    shift = 30;
+    end++;
+    break;
+  }
+  if ( * end != '\0' || n > (SIZE_MAX >> shift)) {
+    return false;
   }
+
+  * out = (size_t) n << shift;
+  return true;
 }
 
 /*
@@ -115,6 +699,27 @@ static void help() {
   printf("-l -> print long listing format, will show symlinks\n");
   printf("-R -> list subdirectories recursively\n");
   printf("-n -> count files only, wont show files\n");
+  printf("-j N -> with -R, list directories on N threads\n");
+  printf("-h -> human readable sizes, with -l\n");
+  printf("-t -> sort by modification time, newest first\n");
+  printf("-S -> sort by size, largest first\n");
+  printf("-X -> sort by extension\n");
+  printf("-U -> don't sort; list entries in directory order\n");
+  printf("-v -> natural sort of numbers within names (file9 before file10)\n");
+  printf("-r -> reverse the sort order\n");
+  printf("--group-directories-first -> list directories before other files\n");
+  printf("--limit=N -> list only the first N entries of each directory\n");
+  printf("--memory-limit=SIZE -> sort directories bigger than this on disk\n");
+  printf("--stream -> like -U, but hold nothing back: constant memory, serial -R\n");
+  printf("--dont-sync -> don't force remote filesystems to revalidate metadata\n");
+  printf("--dirent-buffer=SIZE -> bytes read per getdents64 call (e.g. 1M)\n");
+  printf("--reorder-buffer=SIZE -> with -j, output buffered ahead of the writer\n");
+  printf("--io-uring -> batch metadata lookups through io_uring\n");
+  printf("--queue-depth=N -> with --io-uring, lookups kept in flight (default 64)\n");
+  printf("--stat-threads=N -> look up entries of big directories on N extra threads\n");
+  printf("--id-source=nss|files -> resolve owners through NSS (default) or the files\n");
+  printf("--passwd-file=PATH, --group-file=PATH -> files for --id-source=files\n");
+  printf("--output-buffer=SIZE -> bytes of output gathered per write (default 64K)\n");
   printf("--help -> display this message and exit\n\n");
   printf("exit status:\n");
   printf("0 -> ok\n");
@@ -126,29 +731,68 @@ static void help() {
   exit(0);
 }
 
-static void format_size_human(long long size, char * buffer, size_t buf_size) {
-  const char * units[] = {
-    "B",
-    "K",
-    "M",
-    "G",
-    "T",
-    "P",
-    "E"
-  };
-  int unit_index = 0;
-  double human_size = size;
+/*
+ * format_size_human(): `size` for -h, e.g. "812", "4.0K" or "1.2M", into
+ * `buffer` (at least 24 bytes); returns the length.
+ *
+ * This reproduces what dividing a double by 1024 until it drops below 1024
+ * and printing it with "%.1f" gives, in integers only. The double holds
+ * `size` rounded to 53 bits (to nearest, ties to even) and the divisions by
+ * powers of two are exact, so the printed value is m / 2^(10 * unit) for
+ * that rounded m, taken to one decimal with ties to even like printf does.
+ */
+static size_t format_size_human(long long size, char * buffer) {
+  static const char units[] = "BKMGTPE";
+
+  if (size < 1024) {
+    char * end = buffer + 20;
+    char * p = size < 0 ? format_uint(-(uint64_t) size, end) : format_uint((uint64_t) size, end);
+    if (size < 0) {
+      * --p = '-';
+    }
+    size_t len = (size_t)(end - p);
+    memmove(buffer, p, len);
+    buffer[len] = '\0';
+    return len;
+  }
 
-  while (human_size >= 1024 && unit_index < 6) {
-    human_size /= 1024;
-    unit_index++;
+  // the value the double conversion would have kept
+  uint64_t m = (uint64_t) size;
+  int bits = 64 - __builtin_clzll(m);
+  if (bits > 53) {
+    int drop = bits - 53;
+    uint64_t rest = m & ((1ull << drop) - 1), half = 1ull << (drop - 1);
+    m >>= drop;
+    if (rest > half || (rest == half && (m & 1))) {
+      m++;
+    }
+    m <<= drop;
   }
 
-  if (unit_index == 0) {
-    snprintf(buffer, buf_size, "%lld", size);
-  } else {
-    snprintf(buffer, buf_size, "%.1f%s", human_size, units[unit_index]);
+  int unit = 1;
+  while (unit < 6 && m >> (10 * (unit + 1)) != 0) {
+    unit++;
   }
+
+  // tenths = m * 10 / 2^shift, rounded; split so nothing overflows
+  int shift = 10 * unit;
+  uint64_t low = m & ((1ull << shift) - 1);
+  uint64_t scaled = low * 10;
+  uint64_t tenths = (m >> shift) * 10 + (scaled >> shift);
+  uint64_t rest = scaled & ((1ull << shift) - 1), half = 1ull << (shift - 1);
+  if (rest > half || (rest == half && (tenths & 1))) {
+    tenths++;
+  }
+
+  char * end = buffer + 20;
+  * --end = units[unit];
+  * --end = (char)('0' + tenths % 10);
+  * --end = '.';
+  char * p = format_uint(tenths / 10, end);
+  size_t len = (size_t)(buffer + 20 - p);
+  memmove(buffer, p, len);
+  buffer[len] = '\0';
+  return len;
 }
 
 /*
@@ -176,222 +820,2570 @@ void handle_error(char * what_happened, char * fullname) {
 }
 
 /*
- * test_file():
- * test whether stat() returns successfully and if not, handle error.
- * Use this to test for whether a file or dir exists
+ * join_path(): build "dirname/name" on the heap; the caller frees it. Lookups
+ * all go through directory fds, so a full path is only needed when it is
+ * actually printed (-R headers, error messages). A NULL dirname means `name`
+ * is a command-line argument and already the whole path.
  */
-bool test_file(char * pathandname) {
-  struct stat sb;
-  if (lstat(pathandname, & sb)) {
-    handle_error("cannot access", pathandname);
-    return false;
+static char * join_path(const char * dirname, const char * name) {
+  size_t dirlen = dirname ? strlen(dirname) : 0;
+  size_t namelen = strlen(name);
+  char * path = xrealloc(NULL, dirlen + namelen + 2);
+
+  if (dirname) {
+    memcpy(path, dirname, dirlen);
+    path[dirlen++] = '/';
   }
-  return true;
+  memcpy(path + dirlen, name, namelen + 1);
+  return path;
 }
 
 /*
- * is_dir(): tests whether the argument refers to a directory.
- * precondition: test_file() returns true. that is, call this function
- * only if test_file(pathandname) returned true.
+ * handle_entry_error(): handle_error() for the entry `name` in `dirname`,
+ * building its full path just for the message.
  */
-bool is_dir(char * pathandname) {
-  struct stat sb;
-  if (lstat(pathandname, & sb)) {
-    handle_error("No File Found", "is_dir");
-    return false;
-  }
-  return S_ISDIR(sb.st_mode);
+static void handle_entry_error(char * what_happened, char * dirname,
+  char * name) {
+  int saved_errno = errno;
+  char * path = join_path(dirname, name);
+  errno = saved_errno;
+  handle_error(what_happened, path);
+  free(path);
 }
 
-/* convert the mode field in a struct stat to a file type, for -l printing */
-const char * ftype_to_str(mode_t mode) {
-  if (S_ISDIR(mode)) {
-    return "d";
+/*
+ * A minimal io_uring, driven with the raw syscalls, used only to submit
+ * IORING_OP_STATX for a batch of entries. Each thread sets up its own ring
+ * on first use; if the kernel refuses (too old, seccomp, ...) the thread
+ * quietly falls back to one statx() per entry.
+ */
+struct uring {
+  int fd;
+  unsigned int entries;
+  unsigned int * sq_tail, * sq_mask, * sq_array;
+  unsigned int * cq_head, * cq_tail, * cq_mask;
+  struct io_uring_sqe * sqes;
+  struct io_uring_cqe * cqes;
+  void * sq_ring, * cq_ring;
+  size_t sq_ring_size, cq_ring_size;
+};
+
+static _Thread_local struct uring ring;
+static _Thread_local int ring_state; // 0: not tried yet, 1: usable, -1: not
+
+static bool uring_setup(void) {
+  if (ring_state != 0) {
+    return ring_state > 0;
   }
-  if (S_ISREG(mode)) {
-    return "-";
+  ring_state = -1;
+
+  struct io_uring_params params;
+  memset( & params, 0, sizeof(params));
+  int fd = (int) syscall(SYS_io_uring_setup, queue_depth, & params);
+  if (fd == -1) {
+    return false;
   }
-  if (S_ISLNK(mode)) {
-    return "l";
+
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single) {
+    sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
   }
-  return "?";
-}
 
-/* list_file():
- * implement the logic for listing a single file.
- * This function takes:
- *   - pathandname: the directory name plus the file name.
- *   - name: just the name "component".
- *   - list_long: a flag indicated whether the printout should be in
- *   long mode.
- */
-void list_file(char * pathandname, char * name, bool list_long) {
-  if (count_only) {
-    file_count++;
-    return;
+  void * sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  void * cq = sq;
+  if (sq != MAP_FAILED && !single) {
+    cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      fd, IORING_OFF_CQ_RING);
+  }
+  size_t sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  void * sqes = MAP_FAILED;
+  if (sq != MAP_FAILED && cq != MAP_FAILED) {
+    sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  }
+  if (sqes == MAP_FAILED) {
+    if (cq != MAP_FAILED && cq != sq) {
+      munmap(cq, cq_size);
+    }
+    if (sq != MAP_FAILED) {
+      munmap(sq, sq_size);
+    }
+    close(fd);
+    return false;
   }
 
-  if (list_long) {
-    struct stat sb;
+  ring = (struct uring) {
+    .fd = fd,
+    .entries = params.sq_entries,
+    .sq_tail = (unsigned int * )((char * ) sq + params.sq_off.tail),
+    .sq_mask = (unsigned int * )((char * ) sq + params.sq_off.ring_mask),
+    .sq_array = (unsigned int * )((char * ) sq + params.sq_off.array),
+    .cq_head = (unsigned int * )((char * ) cq + params.cq_off.head),
+    .cq_tail = (unsigned int * )((char * ) cq + params.cq_off.tail),
+    .cq_mask = (unsigned int * )((char * ) cq + params.cq_off.ring_mask),
+    .sqes = sqes,
+    .cqes = (struct io_uring_cqe * )((char * ) cq + params.cq_off.cqes),
+    .sq_ring = sq,
+    .cq_ring = cq,
+    .sq_ring_size = sq_size,
+    .cq_ring_size = cq_size
+  };
+  ring_state = 1;
+  return true;
+}
 
-    if (lstat(pathandname, & sb) == -1) {
-      handle_error("cannot access", pathandname);
-      return;
+static void uring_teardown(void) {
+  if (ring_state > 0) {
+    munmap(ring.sqes, ring.entries * sizeof(struct io_uring_sqe));
+    if (ring.cq_ring != ring.sq_ring) {
+      munmap(ring.cq_ring, ring.cq_ring_size);
     }
+    munmap(ring.sq_ring, ring.sq_ring_size);
+    close(ring.fd);
+  }
+  ring_state = 0;
+}
 
-    printf("%s", ftype_to_str(sb.st_mode));
-
-    // for user permissions
-    PRINT_PERM_CHAR(sb.st_mode, S_IRUSR, "r");
-    PRINT_PERM_CHAR(sb.st_mode, S_IWUSR, "w");
-    PRINT_PERM_CHAR(sb.st_mode, S_IXUSR, "x");
+/*
+ * wants_stat(): whether the listing needs metadata for `e`: all of it for
+ * long listings (`all`), otherwise just the type when d_type didn't say.
+ */
+static bool wants_stat(const struct entry * e, bool all, bool types) {
+  return !e -> have_stat && (all || (types && e -> d_type == DT_UNKNOWN));
+}
 
-    // for group permissions
-    PRINT_PERM_CHAR(sb.st_mode, S_IRGRP, "r");
-    PRINT_PERM_CHAR(sb.st_mode, S_IWGRP, "w");
-    PRINT_PERM_CHAR(sb.st_mode, S_IXGRP, "x");
+/*
+ * stat_uring(): look up the `n` entries of `batch` that need metadata (see
+ * wants_stat()), all relative to `dirfd`, by keeping up to queue_depth
+ * IORING_OP_STATX requests in flight. Results land in the entries; failures
+ * are kept in stat_errno. Returns false, having done nothing, if this thread
+ * has no working ring.
+ */
+static bool stat_uring(int dirfd, struct entry * batch, size_t n, bool all,
+  bool types) {
+  if (!uring_setup()) {
+    return false;
+  }
 
-    // for other permissions
-    PRINT_PERM_CHAR(sb.st_mode, S_IROTH, "r");
-    PRINT_PERM_CHAR(sb.st_mode, S_IWOTH, "w");
-    PRINT_PERM_CHAR(sb.st_mode, S_IXOTH, "x");
+  size_t next = 0;
+  unsigned int inflight = 0, to_submit = 0;
+  while (next < n || inflight > 0) {
+    while (next < n && inflight < ring.entries) {
+      struct entry * e = & batch[next];
+      if (!wants_stat(e, all, types)) {
+        next++;
+        continue;
+      }
 
-    printf(" %ld", (long) sb.st_nlink);
+      unsigned int tail = * ring.sq_tail;
+      unsigned int index = tail & * ring.sq_mask;
+      struct io_uring_sqe * sqe = & ring.sqes[index];
+      memset(sqe, 0, sizeof( * sqe));
+      sqe -> opcode = IORING_OP_STATX;
+      sqe -> fd = dirfd;
+      sqe -> addr = (uint64_t)(uintptr_t) e -> name;
+      sqe -> len = stat_mask;
+      sqe -> off = (uint64_t)(uintptr_t) & e -> stx;
+      sqe -> statx_flags = (uint32_t) stat_flags;
+      sqe -> user_data = next;
+      ring.sq_array[index] = index;
+      __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
 
-    // printing the owner name
-    char owner[32];
-    if (uname_for_uid(sb.st_uid, owner, sizeof(owner)) == 0) {
-      printf(" %-8s", owner);
-    } else {
-      printf(" %-8d", sb.st_uid);
-      err_code |= (1 << 6) | (1 << 5);
+      next++;
+      inflight++;
+      to_submit++;
     }
-
-    // group name
-    char group[32];
-    if (group_for_gid(sb.st_gid, group, sizeof(group)) == 0) {
-      printf(" %-8s", group);
-    } else {
-      printf(" %-8d", sb.st_gid);
-      err_code |= (1 << 6) | (1 << 5);
+    if (inflight == 0) {
+      break;
     }
 
-    // pringing file size
-    if (human_readable) {
-      char hr_size[16];
-      format_size_human((long long) sb.st_size, hr_size, sizeof(hr_size));
-      printf(" %5s", hr_size);
-    } else {
-      printf(" %8lld", (long long) sb.st_size);
+    long ret = syscall(SYS_io_uring_enter, ring.fd, to_submit, 1,
+      IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret == -1) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+        continue;
+      }
+      // The ring is unusable: take back what it didn't accept and let
+      // stat_entry() look those up. Only possible with nothing else in
+      // flight, since those would still write into `batch`.
+      if (inflight == to_submit) {
+        * ring.sq_tail -= to_submit;
+        ring_state = -1;
+        return true;
+      }
+      continue;
     }
+    to_submit -= (unsigned int) ret;
 
-    // modification time
-    char mod_time[64];
-    date_string( & sb.st_mtim, mod_time, sizeof(mod_time));
-    printf(" %s", mod_time);
-
-    // the file name
-    if (S_ISLNK(sb.st_mode)) {
-      char target[1024];
-      ssize_t target_len = readlink(pathandname, target, sizeof(target) - 1);
-      if (target_len != -1) {
-        target[target_len] = '\0';
-        printf(" %s -> %s\n", name, target);
+    unsigned int head = * ring.cq_head;
+    unsigned int tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      struct io_uring_cqe * cqe = & ring.cqes[head & * ring.cq_mask];
+      struct entry * e = & batch[cqe -> user_data];
+      if (cqe -> res < 0) {
+        e -> stat_errno = -cqe -> res;
       } else {
-        printf(" %s -> ?\n", name); // if we can't read the link
+        e -> have_stat = true;
+        e -> d_type = IFTODT(e -> stx.stx_mode);
       }
-    } else {
-      printf(" %s", name);
-
-      // adding / for the directories
-      if (S_ISDIR(sb.st_mode) && strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
-        printf("/");
-      }
-
-      printf("\n");
+      inflight--;
     }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+  }
+  return true;
+}
 
-  } else {
-    if (!test_file(pathandname)) {
-      return;
+/*
+ * stat_range(): look up the entries of `batch` that need metadata, through
+ * this thread's ring with --io-uring or one statx() at a time otherwise.
+ * Like stat_uring(), failures are only recorded in stat_errno.
+ */
+static void stat_range(int dirfd, struct entry * batch, size_t n, bool all,
+  bool types) {
+  if (use_uring && stat_uring(dirfd, batch, n, all, types)) {
+    return;
+  }
+  for (size_t index = 0; index < n; index++) {
+    struct entry * e = & batch[index];
+    if (!wants_stat(e, all, types)) {
+      continue;
     }
-
-    printf("%s", name);
-
-    // making sure if it isn't "." or ".." case
-    if (is_dir(pathandname) && strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
-      printf("/");
+    if (statx(dirfd, e -> name, stat_flags, stat_mask, & e -> stx) == -1) {
+      e -> stat_errno = errno;
+    } else {
+      e -> have_stat = true;
+      e -> d_type = IFTODT(e -> stx.stx_mode);
     }
-
-    printf("\n");
   }
 }
 
-/* list_dir():
- * implement the logic for listing a directory.
+/*
+ * --stat-threads: a pool of helper threads for directories too big for one
+ * thread to stat quickly. A batch is cut into STAT_CHUNK-entry chunks that
+ * the helpers and the submitting thread look up side by side; the entries
+ * stay where they are, so the listing afterwards walks them in getdents64
+ * order as usual. Several -j workers may have batches queued at once.
+ */
+#define STAT_CHUNK 256
+
+struct stat_job {
+  struct stat_job * next;
+  int dirfd;
+  struct entry * batch;
+  size_t n;
+  bool all, types;
+  size_t nchunks;
+  size_t next_chunk; // both counters are protected by stat_pool.lock
+  size_t done_chunks;
+};
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t work; // a job was queued
+  pthread_cond_t done; // a chunk was finished
+  struct stat_job * jobs;
+  size_t started; // helper threads running
+} stat_pool = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .work = PTHREAD_COND_INITIALIZER,
+  .done = PTHREAD_COND_INITIALIZER
+};
+
+/*
+ * claim_chunk(): with stat_pool.lock held, pick the next unclaimed chunk of
+ * `only`, or of any queued job if `only` is NULL. Returns its job, or NULL.
+ */
+static struct stat_job * claim_chunk(struct stat_job * only, size_t * chunk) {
+  for (struct stat_job * job = only ? only : stat_pool.jobs; job != NULL;
+    job = only ? NULL : job -> next) {
+    if (job -> next_chunk < job -> nchunks) {
+      * chunk = job -> next_chunk++;
+      return job;
+    }
+  }
+  return NULL;
+}
+
+/* run_chunk(): look up one chunk; called and returns with the lock held. */
+static void run_chunk(struct stat_job * job, size_t chunk) {
+  pthread_mutex_unlock( & stat_pool.lock);
+  size_t lo = chunk * STAT_CHUNK;
+  size_t count = job -> n - lo < STAT_CHUNK ? job -> n - lo : STAT_CHUNK;
+  stat_range(job -> dirfd, job -> batch + lo, count, job -> all, job -> types);
+  pthread_mutex_lock( & stat_pool.lock);
+  if (++job -> done_chunks == job -> nchunks) {
+    pthread_cond_broadcast( & stat_pool.done);
+  }
+}
+
+static void * stat_helper_main(void * arg) {
+  (void) arg;
+  pthread_mutex_lock( & stat_pool.lock);
+  for (;;) {
+    size_t chunk;
+    struct stat_job * job = claim_chunk(NULL, & chunk);
+    if (job == NULL) {
+      pthread_cond_wait( & stat_pool.work, & stat_pool.lock);
+      continue;
+    }
+    run_chunk(job, chunk);
+  }
+  return NULL;
+}
+
+/*
+ * stat_batch(): look up everything the listing will need for the `n`
+ * entries of `batch` before they are listed. Failures are kept in
+ * stat_errno and reported by stat_entry() when the entry is listed, so
+ * messages still come out in listing order. With neither --io-uring nor
+ * --stat-threads this does nothing and stat_entry() looks each entry up as
+ * it is listed.
+ */
+static void stat_batch(int dirfd, struct entry * batch, size_t n, bool all,
+  bool types) {
+  if (stat_threads == 0 || n < 2 * STAT_CHUNK) {
+    if (use_uring) {
+      stat_range(dirfd, batch, n, all, types);
+    }
+    return;
+  }
+
+  struct stat_job job = {
+    .next = NULL, .dirfd = dirfd, .batch = batch, .n = n, .all = all,
+    .types = types, .nchunks = (n + STAT_CHUNK - 1) / STAT_CHUNK,
+    .next_chunk = 0, .done_chunks = 0
+  };
+
+  pthread_mutex_lock( & stat_pool.lock);
+  while (stat_pool.started < stat_threads) {
+    pthread_t thread;
+    if (pthread_create( & thread, NULL, stat_helper_main, NULL) != 0) {
+      break; // whatever helpers we have will do
+    }
+    pthread_detach(thread);
+    stat_pool.started++;
+  }
+  job.next = stat_pool.jobs;
+  stat_pool.jobs = & job;
+  pthread_cond_broadcast( & stat_pool.work);
+
+  // pitch in, then wait for the chunks the helpers took
+  size_t chunk;
+  while (claim_chunk( & job, & chunk) != NULL) {
+    run_chunk( & job, chunk);
+  }
+  while (job.done_chunks < job.nchunks) {
+    pthread_cond_wait( & stat_pool.done, & stat_pool.lock);
+  }
+
+  struct stat_job ** link = & stat_pool.jobs;
+  while ( * link != & job) {
+    link = & ( * link) -> next;
+  }
+  * link = job.next;
+  pthread_mutex_unlock( & stat_pool.lock);
+}
+
+/*
+ * lookup_entry(): stat_entry() without the error report. A failure is left
+ * in e -> stat_errno for whoever lists the entry.
+ */
+static bool lookup_entry(int dirfd, struct entry * e) {
+  if (e -> have_stat) {
+    return true;
+  }
+  if (e -> stat_errno == 0) {
+    if (statx(dirfd, e -> name, stat_flags, stat_mask, & e -> stx) == 0) {
+      e -> have_stat = true;
+      e -> d_type = IFTODT(e -> stx.stx_mode);
+      return true;
+    }
+    e -> stat_errno = errno;
+  }
+  return false;
+}
+
+/*
+ * stat_entry(): fill in the metadata of `e`, unless that already happened.
+ * This is the only place an entry gets stat'ed, so every inode costs at
+ * most one metadata syscall no matter how many callers need its type, mode
+ * or size. Only the fields in stat_mask are requested, and the lookup is
+ * relative to `dirfd` so its cost doesn't grow with the depth of the tree.
+ * Entries already looked up by stat_batch() are just passed through. On
+ * failure the error is reported and false is returned.
+ */
+static bool stat_entry(int dirfd, char * dirname, struct entry * e) {
+  if (lookup_entry(dirfd, e)) {
+    return true;
+  }
+  errno = e -> stat_errno;
+  handle_entry_error("cannot access", dirname, e -> name);
+  return false;
+}
+
+/* fill mode_table; called once from main() before anything is listed */
+static void init_mode_table(void) {
+  for (unsigned int mode = 0; mode < 4096; mode++) {
+    char * p = mode_table[mode];
+    p[0] = '?';
+    p[1] = mode & S_IRUSR ? 'r' : '-';
+    p[2] = mode & S_IWUSR ? 'w' : '-';
+    p[3] = mode & S_ISUID ? (mode & S_IXUSR ? 's' : 'S') : (mode & S_IXUSR ? 'x' : '-');
+    p[4] = mode & S_IRGRP ? 'r' : '-';
+    p[5] = mode & S_IWGRP ? 'w' : '-';
+    p[6] = mode & S_ISGID ? (mode & S_IXGRP ? 's' : 'S') : (mode & S_IXGRP ? 'x' : '-');
+    p[7] = mode & S_IROTH ? 'r' : '-';
+    p[8] = mode & S_IWOTH ? 'w' : '-';
+    p[9] = mode & S_ISVTX ? (mode & S_IXOTH ? 't' : 'T') : (mode & S_IXOTH ? 'x' : '-');
+  }
+}
+
+/* format_mode(): the 10-character "drwxr-xr-x" field for `mode` into `out` */
+static inline void format_mode(mode_t mode, char out[10]) {
+  memcpy(out, mode_table[mode & 07777], 10);
+  char type = ftype_chars[(mode & S_IFMT) >> 12];
+  out[0] = type ? type : '?';
+}
+
+/*
+ * Long and sorted listings are written in two passes: each entry's columns
+ * are stored as a row, with its name copied into the `names` arena, while
+ * the widest value of every column is tracked; then the rows are sorted and
+ * rendered padded to those widths. The rows keep what statx() returned, so
+ * sorting and rendering never look anything up again (apart from
+ * readlinkat() for symlink targets).
+ *
+ * A sorted directory is held whole (but see --memory-limit). An unsorted
+ * (-U) long listing is held up to ROW_BATCH rows; past that, the rows so far
+ * are written out and the next batch starts with the widths reached so far,
+ * which only grow, so a huge directory costs a bounded buffer at the price
+ * of later batches perhaps being a little wider than earlier ones.
+ */
+#define ROW_BATCH 65536
+
+// One row, as handed to and from row_buf (see row_get() and row_put()) and
+// as rendered.
+struct row {
+  char * name;
+  char * key; // its strxfrm() or -v key, once make_sort_item() built it
+  int stat_errno; // the lookup failed; reported in place of the row
+  mode_t mode;
+  uint32_t uid, gid;
+  uint64_t nlink;
+  uint64_t size;
+  struct timespec mtime;
+  const char * owner, * group; // NULL: print the number
+};
+
+struct col_widths {
+  size_t nlink, owner, group, size;
+};
+
+// the widths the columns had before they were computed; tables never get
+// narrower than this
+static struct col_widths min_widths = {
+  .nlink = 0, .owner = 8, .group = 8, .size = 8
+};
+
+/*
+ * struct arena: a bump allocator for the names and sort keys of a
+ * directory's rows. Chunks are never moved, so rows point straight at their
+ * strings, and arena_free() hands the lot back in one go.
+ */
+struct arena_chunk {
+  struct arena_chunk * prev;
+  size_t size;
+  char data[];
+};
+
+struct arena {
+  struct arena_chunk * chunk; // the one being filled; older ones hang off it
+  char * next, * end; // its free part
+  size_t used; // bytes handed out, in all chunks
+};
+
+#define ARENA_CHUNK (64 * 1024)
+#define ARENA_CHUNK_MAX (16 * 1024 * 1024)
+
+/* arena_room(): make sure `n` bytes are free at a -> next; returns it */
+static char * arena_room(struct arena * a, size_t n) {
+  if (a -> chunk == NULL || (size_t)(a -> end - a -> next) < n) {
+    size_t size = a -> chunk == NULL ? ARENA_CHUNK : a -> chunk -> size < ARENA_CHUNK_MAX ?
+      a -> chunk -> size * 2 : ARENA_CHUNK_MAX;
+    if (size < n) {
+      size = n;
+    }
+    struct arena_chunk * c = xrealloc(NULL, sizeof( * c) + size);
+    c -> prev = a -> chunk;
+    c -> size = size;
+    a -> chunk = c;
+    a -> next = c -> data;
+    a -> end = c -> data + size;
+  }
+  return a -> next;
+}
+
+/* arena_take(): hand out the first `n` bytes at a -> next */
+static void arena_take(struct arena * a, size_t n) {
+  a -> next += n;
+  a -> used += n;
+}
+
+static char * arena_copy(struct arena * a, const void * p, size_t n) {
+  char * copy = arena_room(a, n);
+  memcpy(copy, p, n);
+  arena_take(a, n);
+  return copy;
+}
+
+/* arena_unwind(): take back `p`, the last thing handed out, and all after it */
+static void arena_unwind(struct arena * a, char * p) {
+  a -> used -= (size_t)(a -> next - p);
+  a -> next = p;
+}
+
+static void arena_free(struct arena * a) {
+  while (a -> chunk != NULL) {
+    struct arena_chunk * prev = a -> chunk -> prev;
+    free(a -> chunk);
+    a -> chunk = prev;
+  }
+  a -> next = a -> end = NULL;
+  a -> used = 0;
+}
+
+/*
+ * The rows themselves are stored a column to an array, all of them carved
+ * out of one allocation, `columns`. Building the sort keys reads just the
+ * columns the sort order needs, packed together; row_get() and row_put()
+ * move whole rows in and out.
+ */
+#define ROW_BYTES (sizeof(struct timespec) + 2 * sizeof(char * ) + \
+  2 * sizeof(uint64_t) + sizeof(int) + sizeof(mode_t) + 2 * sizeof(uint32_t))
+
+static _Thread_local struct {
+  size_t count, cap;
+  void * columns;
+  struct timespec * mtime;
+  char ** name, ** key;
+  uint64_t * nlink, * size;
+  int * stat_errno;
+  mode_t * mode;
+  uint32_t * uid, * gid;
+  struct arena names, keys;
+  size_t names_dead; // bytes of names whose rows --limit has dropped
+  bool list_long;
+  struct col_widths widths;
+} row_buf;
+
+/* rows_room(): make room for `n` rows */
+static void rows_room(size_t n) {
+  if (n <= row_buf.cap) {
+    return;
+  }
+  size_t cap = row_buf.cap ? row_buf.cap * 2 : 256;
+  while (cap < n) {
+    cap *= 2;
+  }
+  // widest first, so every column stays aligned
+  static const size_t sizes[] = {
+    sizeof(struct timespec), sizeof(char * ), sizeof(char * ), sizeof(uint64_t),
+    sizeof(uint64_t), sizeof(int), sizeof(mode_t), sizeof(uint32_t), sizeof(uint32_t)
+  };
+
+  // grown in place where realloc() can; the columns then move up to their
+  // new starts, the last one first so none is overwritten before it moves
+  char * block = xrealloc(row_buf.columns, cap * ROW_BYTES);
+  size_t offset = ROW_BYTES;
+  for (size_t col = sizeof(sizes) / sizeof(sizes[0]); col-- > 0;) {
+    offset -= sizes[col];
+    memmove(block + offset * cap, block + offset * row_buf.cap, row_buf.count * sizes[col]);
+  }
+  row_buf.columns = block;
+  row_buf.cap = cap;
+
+  row_buf.mtime = (struct timespec * ) block;
+  row_buf.name = (char ** )(row_buf.mtime + cap);
+  row_buf.key = row_buf.name + cap;
+  row_buf.nlink = (uint64_t * )(row_buf.key + cap);
+  row_buf.size = row_buf.nlink + cap;
+  row_buf.stat_errno = (int * )(row_buf.size + cap);
+  row_buf.mode = (mode_t * )(row_buf.stat_errno + cap);
+  row_buf.uid = (uint32_t * )(row_buf.mode + cap);
+  row_buf.gid = row_buf.uid + cap;
+}
+
+static void row_put(size_t index, const struct row * r) {
+  row_buf.name[index] = r -> name;
+  row_buf.key[index] = r -> key;
+  row_buf.stat_errno[index] = r -> stat_errno;
+  row_buf.mode[index] = r -> mode;
+  row_buf.uid[index] = r -> uid;
+  row_buf.gid[index] = r -> gid;
+  row_buf.nlink[index] = r -> nlink;
+  row_buf.size[index] = r -> size;
+  row_buf.mtime[index] = r -> mtime;
+}
+
+/* row_get(): row `index`, with its owner and group for the long format */
+static void row_get(size_t index, struct row * r) {
+  * r = (struct row) {
+    .name = row_buf.name[index], .key = row_buf.key[index],
+    .stat_errno = row_buf.stat_errno[index], .mode = row_buf.mode[index],
+    .uid = row_buf.uid[index], .gid = row_buf.gid[index],
+    .nlink = row_buf.nlink[index], .size = row_buf.size[index],
+    .mtime = row_buf.mtime[index], .owner = NULL, .group = NULL
+  };
+  if (row_buf.list_long && r -> stat_errno == 0) {
+    r -> owner = uname_for_uid(r -> uid);
+    r -> group = group_for_gid(r -> gid);
+  }
+}
+
+static bool is_dot_or_dotdot(const char * name) {
+  return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+static size_t count_digits(uint64_t v) {
+  size_t digits = 1;
+  while (v >= 10) {
+    v /= 10;
+    digits++;
+  }
+  return digits;
+}
+
+static void widen(size_t * width, size_t len) {
+  if (len > * width) {
+    * width = len;
+  }
+}
+
+static void widen_row(struct row * r, struct col_widths * widths);
+
+/*
+ * fill_row(): the columns of entry `e`. For the long format (`widths` set)
+ * the entry must have been stat'ed, and `widths` is widened to fit; short
+ * listings may have nothing but the type from the directory.
+ */
+static void fill_row(struct row * r, struct entry * e, struct col_widths * widths) {
+  if (!e -> have_stat) {
+    * r = (struct row) {
+      .name = r -> name, .key = NULL, .stat_errno = 0, .mode = DTTOIF(e -> d_type)
+    };
+    return;
+  }
+
+  struct statx * stx = & e -> stx;
+  r -> stat_errno = 0;
+  r -> mode = stx -> stx_mode;
+  r -> uid = stx -> stx_uid;
+  r -> gid = stx -> stx_gid;
+  r -> nlink = stx -> stx_nlink;
+  r -> size = stx -> stx_size;
+  r -> mtime.tv_sec = stx -> stx_mtime.tv_sec;
+  r -> mtime.tv_nsec = stx -> stx_mtime.tv_nsec;
+  r -> owner = r -> group = NULL;
+  if (widths != NULL) {
+    widen_row(r, widths);
+  }
+}
+
+/*
+ * widen_row(): resolve the owner and group of stat'ed row `r` for the long
+ * format, and widen `widths` to fit its columns
+ */
+static void widen_row(struct row * r, struct col_widths * widths) {
+  r -> owner = uname_for_uid(r -> uid);
+  r -> group = group_for_gid(r -> gid);
+  if (r -> owner == NULL || r -> group == NULL) {
+    err_code |= (1 << 6) | (1 << 5);
+  }
+
+  widen( & widths -> nlink, count_digits(r -> nlink));
+  widen( & widths -> owner, r -> owner ? strlen(r -> owner) : count_digits(r -> uid));
+  widen( & widths -> group, r -> group ? strlen(r -> group) : count_digits(r -> gid));
+  if (human_readable) {
+    char hr_size[24];
+    widen( & widths -> size, format_size_human((long long) r -> size, hr_size));
+  } else {
+    widen( & widths -> size, count_digits(r -> size));
+  }
+}
+
+/* render_row(): one line of the long format, padded to `widths` */
+static void render_row(int dirfd, struct row * r, char * name,
+  struct col_widths * widths) {
+  // type and permissions, all ten characters in one go
+  char mode[10];
+  format_mode(r -> mode, mode);
+  out_mem(mode, sizeof(mode));
+
+  out_char(' ');
+  out_uint(r -> nlink, widths -> nlink, false);
+
+  // printing the owner name
+  out_char(' ');
+  if (r -> owner != NULL) {
+    out_field(r -> owner, strlen(r -> owner), widths -> owner, true);
+  } else {
+    out_uint(r -> uid, widths -> owner, true);
+  }
+
+  // group name
+  out_char(' ');
+  if (r -> group != NULL) {
+    out_field(r -> group, strlen(r -> group), widths -> group, true);
+  } else {
+    out_uint(r -> gid, widths -> group, true);
+  }
+
+  // pringing file size
+  out_char(' ');
+  if (human_readable) {
+    char hr_size[24];
+    size_t len = format_size_human((long long) r -> size, hr_size);
+    out_field(hr_size, len, widths -> size, false);
+  } else {
+    out_uint(r -> size, widths -> size, false);
+  }
+
+  // modification time
+  char mod_time[64];
+  out_char(' ');
+  out_mem(mod_time, date_string( & r -> mtime, mod_time, sizeof(mod_time)));
+
+  // the file name
+  out_char(' ');
+  out_str(name);
+  if (S_ISLNK(r -> mode)) {
+    char target[1024];
+    ssize_t target_len = readlinkat(dirfd, name, target,
+      sizeof(target) - 1);
+    out_str(" -> ");
+    if (target_len != -1) {
+      out_mem(target, (size_t) target_len);
+    } else {
+      out_char('?'); // if we can't read the link
+    }
+  } else if (S_ISDIR(r -> mode) && strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+    // adding / for the directories
+    out_char('/');
+  }
+  out_char('\n');
+}
+
+/* rows_begin(): start the table of a new directory */
+static void rows_begin(bool list_long) {
+  row_buf.count = 0;
+  row_buf.names_dead = 0;
+  row_buf.list_long = list_long;
+  row_buf.widths = min_widths;
+}
+
+/* rows_clear(): drop the rows written out, names and keys and all */
+static void rows_clear(void) {
+  row_buf.count = 0;
+  row_buf.names_dead = 0;
+  arena_free( & row_buf.names);
+  arena_free( & row_buf.keys);
+}
+
+
+/*
+ * Sorting: every row gets a struct sort_item with its sort key boiled down
+ * to integers, so that nearly all comparisons are a few integer compares in
+ * one small contiguous array. `key`/`key2` hold the -t/-S value, arranged so
+ * that ascending order is the listing order, or the first bytes of the -X
+ * extension; `name` the first bytes of the name's collation key. Only when
+ * all of those tie are the full strings compared.
+ *
+ * The collation key is the name itself in the C locale. Otherwise strxfrm()
+ * turns each name into a key, once, into row_buf.keys, so that comparing
+ * keys with strcmp() orders them as strcoll() would the names. -v builds its
+ * own kind of key there instead.
+ */
+struct sort_item {
+  uint32_t group; // with --group-directories-first: 0 for directories
+  uint32_t row;
+  uint64_t key, key2;
+  uint64_t name;
+};
+
+static _Thread_local struct sort_item * sort_items, * sort_spare;
+static _Thread_local size_t sort_items_cap;
+
+/* the first eight bytes of `s`, big-endian, so they compare like strcmp() */
+static uint64_t string_prefix(const char * s) {
+  uint64_t prefix = 0;
+  for (int index = 0; index < 8 && s[index] != '\0'; index++) {
+    prefix |= (uint64_t)(unsigned char) s[index] << (56 - 8 * index);
+  }
+  return prefix;
+}
+
+static const char * extension(const char * name) {
+  const char * dot = strrchr(name, '.');
+  return dot ? dot + 1 : "";
+}
+
+static int compare_u64(uint64_t a, uint64_t b) {
+  return a < b ? -1 : a > b;
+}
+
+static bool keyed_names(void) {
+  return use_collation || sort_by == SORT_VERSION;
+}
+
+/* the key row `index` is ordered by: its name, or the key built from it */
+static const char * collation_key(size_t index) {
+  return keyed_names() ? row_buf.key[index] : row_buf.name[index];
+}
+
+/*
+ * -v keys: made so that comparing them byte by byte gives the order of GNU
+ * ls -v (gnulib's filevercmp()). ".", "..", then other dot files, then the
+ * rest; names are compared without their suffix (a trailing run of ".ext"
+ * parts) first, and with it only if that ties. Within a name, runs of
+ * digits compare as numbers, by their count of significant digits and then
+ * the digits, so "file9" < "file10"; the text between them compares '~'
+ * first, then letters, then other characters. (A zero run followed by '~'
+ * is the one case where the order can differ from gnulib's.)
+ *
+ * version_text() encodes the first `len` bytes of `s`: 1 for '~', letters as
+ * themselves, other characters as 0xff and the character, and 2 wherever a
+ * stretch of text ends. A number follows its 2 as the count of significant
+ * digits plus two, then those digits. The key is the class of the name, the
+ * text without the suffix, a 1, and the text with it.
+ */
+static unsigned char * version_text(unsigned char * p, const unsigned char * s,
+  size_t len) {
+  const unsigned char * end = s + len;
+  while (s < end) {
+    unsigned char c = * s;
+    if (c >= '0' && c <= '9') {
+      while (s < end && * s == '0') {
+        s++; // leading zeros don't count
+      }
+      const unsigned char * digits = s;
+      while (s < end && * s >= '0' && * s <= '9') {
+        s++;
+      }
+      size_t count = (size_t)(s - digits);
+      if (count == 0 && s == end) {
+        break; // a trailing zero is the same as no number at all
+      }
+      * p++ = 2;
+      * p++ = (unsigned char)(count < 253 ? count + 2 : 255);
+      memcpy(p, digits, count);
+      p += count;
+      continue;
+    }
+    if (c == '~') {
+      * p++ = 1;
+    } else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) {
+      * p++ = c;
+    } else {
+      * p++ = 0xff;
+      * p++ = c;
+    }
+    s++;
+  }
+  * p++ = 2;
+  return p;
+}
+
+static bool is_alpha_or_tilde(unsigned char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '~';
+}
+
+/* version_prefix(): how much of `s` is left without its suffix */
+static size_t version_prefix(const unsigned char * s, size_t len) {
+  for (size_t index = 0;; index++) {
+    size_t prefix = index;
+    while (index + 1 < len && s[index] == '.' && is_alpha_or_tilde(s[index + 1])) {
+      index += 2;
+      while (index < len && (is_alpha_or_tilde(s[index]) ||
+          (s[index] >= '0' && s[index] <= '9'))) {
+        index++;
+      }
+    }
+    if (index >= len) {
+      return prefix;
+    }
+  }
+}
+
+/* add_version_key(): the -v key of the name of row `index`, into row_buf.keys */
+static void add_version_key(size_t index) {
+  const unsigned char * name = (const unsigned char *) row_buf.name[index];
+  size_t len = strlen((const char *) name);
+  unsigned char * key = (unsigned char *) arena_room( & row_buf.keys, 6 * len + 5);
+  unsigned char * p = key;
+
+  * p++ = name[0] != '.' ? 4 : is_dot_or_dotdot((const char *) name) ? (unsigned char) len : 3;
+  p = version_text(p, name, version_prefix(name, len));
+  * p++ = 1;
+  p = version_text(p, name, len);
+  * p++ = '\0';
+
+  row_buf.key[index] = (char *) key;
+  arena_take( & row_buf.keys, (size_t)(p - key));
+}
+
+/* add_collation_key(): strxfrm() the name of row `index` into row_buf.keys */
+static void add_collation_key(size_t index) {
+  const char * name = row_buf.name[index];
+  size_t want = strlen(name) + 1; // usually plenty; strxfrm() says if not
+  for (;;) {
+    char * key = arena_room( & row_buf.keys, want);
+    size_t room = (size_t)(row_buf.keys.end - key);
+    size_t len = strxfrm(key, name, room);
+    if (len < room) {
+      row_buf.key[index] = key;
+      arena_take( & row_buf.keys, len + 1);
+      return;
+    }
+    want = len + 1;
+  }
+}
+
+/* compare_keys(): the listing order of two items of the same group */
+static int compare_keys(const struct sort_item * a, const struct sort_item * b) {
+  int diff = compare_u64(a -> key, b -> key);
+  if (diff == 0) {
+    diff = compare_u64(a -> key2, b -> key2);
+  }
+  if (diff != 0) {
+    return diff;
+  }
+
+  const char * name_a = row_buf.name[a -> row];
+  const char * name_b = row_buf.name[b -> row];
+  if (sort_by == SORT_EXTENSION) {
+    // the prefix in `key` is only byte order; collation needs a real look
+    diff = use_collation ? strcoll(extension(name_a), extension(name_b)) :
+      strcmp(extension(name_a), extension(name_b));
+    if (diff != 0) {
+      return diff;
+    }
+  }
+  diff = compare_u64(a -> name, b -> name);
+  if (diff == 0) {
+    diff = strcmp(collation_key(a -> row), collation_key(b -> row));
+  }
+  if (diff == 0 && keyed_names()) {
+    diff = strcmp(name_a, name_b); // names whose keys are equal
+  }
+  return diff;
+}
+
+static int compare_items(const void * pa, const void * pb) {
+  const struct sort_item * a = pa, * b = pb;
+  if (a -> group != b -> group) {
+    return a -> group < b -> group ? -1 : 1;
+  }
+  int diff = compare_keys(a, b);
+  return sort_reverse ? -diff : diff;
+}
+
+static int compare_items_forward(const void * pa, const void * pb) {
+  return compare_keys(pa, pb);
+}
+
+/*
+ * radix_sort_names(): the name sort. An LSD radix sort on the eight-byte
+ * name prefix, byte passes that would not move anything skipped, then one
+ * pass on the group; what is left are runs of equal prefixes, which
+ * compare_keys() puts in order. -r flips each group at the end.
+ */
+static void radix_sort_names(size_t n) {
+  struct sort_item * from = sort_items, * to = sort_spare;
+  size_t counts[256];
+
+  for (int pass = 0; pass <= 8; pass++) {
+    if (pass == 8 && !dirs_first) {
+      break;
+    }
+    memset(counts, 0, sizeof(counts));
+    for (size_t index = 0; index < n; index++) {
+      counts[pass < 8 ? (from[index].name >> (8 * pass)) & 0xff : from[index].group]++;
+    }
+    size_t first = pass < 8 ? (from[0].name >> (8 * pass)) & 0xff : from[0].group;
+    if (counts[first] == n) {
+      continue;
+    }
+    size_t offset = 0;
+    for (int byte = 0; byte < 256; byte++) {
+      size_t count = counts[byte];
+      counts[byte] = offset;
+      offset += count;
+    }
+    for (size_t index = 0; index < n; index++) {
+      size_t byte = pass < 8 ? (from[index].name >> (8 * pass)) & 0xff : from[index].group;
+      to[counts[byte]++] = from[index];
+    }
+    struct sort_item * swap = from;
+    from = to;
+    to = swap;
+  }
+  if (from != sort_items) {
+    memcpy(sort_items, from, n * sizeof( * sort_items));
+  }
+
+  for (size_t start = 0, end; start < n; start = end) {
+    end = start + 1;
+    while (end < n && sort_items[end].name == sort_items[start].name &&
+      sort_items[end].group == sort_items[start].group) {
+      end++;
+    }
+    if (end - start > 1) {
+      qsort(sort_items + start, end - start, sizeof( * sort_items),
+        compare_items_forward);
+    }
+  }
+
+  if (sort_reverse) {
+    for (size_t start = 0, end; start < n; start = end) {
+      end = start + 1;
+      while (end < n && sort_items[end].group == sort_items[start].group) {
+        end++;
+      }
+      for (size_t lo = start, hi = end - 1; lo < hi; lo++, hi--) {
+        struct sort_item tmp = sort_items[lo];
+        sort_items[lo] = sort_items[hi];
+        sort_items[hi] = tmp;
+      }
+    }
+  }
+}
+
+static void sort_items_room(size_t n) {
+  if (n > sort_items_cap) {
+    sort_items_cap = sort_items_cap * 2 > n ? sort_items_cap * 2 : n;
+    sort_items = xrealloc(sort_items, sort_items_cap * sizeof( * sort_items));
+    sort_spare = xrealloc(sort_spare, sort_items_cap * sizeof( * sort_spare));
+  }
+}
+
+// Room for this many rows is kept from one directory to the next; a table
+// that had to grow past it gives the memory back once its directory is done.
+#define ROW_KEEP 4096
+
+/*
+ * rows_end(): the directory is done. Its names and keys go, and so do its
+ * columns and sort items if there was room for more than `keep` rows.
+ */
+static void rows_end(size_t keep) {
+  rows_clear();
+  if (row_buf.cap > keep) {
+    free(row_buf.columns);
+    row_buf.columns = NULL;
+    row_buf.cap = 0;
+  }
+  if (sort_items_cap > keep) {
+    free(sort_items);
+    free(sort_spare);
+    sort_items = sort_spare = NULL;
+    sort_items_cap = 0;
+  }
+}
+
+/* make_sort_item(): the sort item of row `index`, building its key if needed */
+static void make_sort_item(struct sort_item * item, size_t index) {
+  if (sort_by == SORT_VERSION) {
+    add_version_key(index);
+  } else if (use_collation) {
+    add_collation_key(index);
+  }
+  item -> row = (uint32_t) index;
+  item -> group = dirs_first && !S_ISDIR(row_buf.mode[index]);
+  item -> key = item -> key2 = 0;
+  item -> name = string_prefix(collation_key(index));
+
+  switch (sort_by) {
+  case SORT_TIME:
+    // newest first: flip the sign bit so signed seconds order as unsigned
+    item -> key = ~((uint64_t) row_buf.mtime[index].tv_sec ^ (1ull << 63));
+    item -> key2 = ~(uint64_t) row_buf.mtime[index].tv_nsec;
+    break;
+  case SORT_SIZE:
+    item -> key = ~row_buf.size[index];
+    break;
+  case SORT_EXTENSION:
+    if (!use_collation) {
+      item -> key = string_prefix(extension(row_buf.name[index]));
+    }
+    break;
+  }
+}
+
+/* sort_rows(): the order to write row_buf's rows in, in sort_items */
+static void sort_rows(void) {
+  sort_items_room(row_buf.count);
+  arena_free( & row_buf.keys);
+  for (size_t index = 0; index < row_buf.count; index++) {
+    make_sort_item( & sort_items[index], index);
+  }
+
+  if (sort_by == SORT_NAME || sort_by == SORT_VERSION) {
+    radix_sort_names(row_buf.count);
+  } else {
+    qsort(sort_items, row_buf.count, sizeof( * sort_items), compare_items);
+  }
+}
+
+/*
+ * Binary heaps of sort items, ordered by compare_items() times `order`: the
+ * item that goes last is on top for order 1, the one that goes first for -1.
+ */
+static void heap_sift_up(size_t index, int order) {
+  while (index > 0) {
+    size_t parent = (index - 1) / 2;
+    if (order * compare_items( & sort_items[parent], & sort_items[index]) >= 0) {
+      break;
+    }
+    struct sort_item tmp = sort_items[parent];
+    sort_items[parent] = sort_items[index];
+    sort_items[index] = tmp;
+    index = parent;
+  }
+}
+
+static void heap_sift_down(size_t index, size_t n, int order) {
+  for (;;) {
+    size_t top = index, child = 2 * index + 1;
+    for (size_t last = child + 2; child < n && child < last; child++) {
+      if (order * compare_items( & sort_items[child], & sort_items[top]) > 0) {
+        top = child;
+      }
+    }
+    if (top == index) {
+      return;
+    }
+    struct sort_item tmp = sort_items[top];
+    sort_items[top] = sort_items[index];
+    sort_items[index] = tmp;
+    index = top;
+  }
+}
+
+/*
+ * --memory-limit: a sorted listing that would outgrow the limit is sorted
+ * in runs. Whenever the rows collected come to half the limit (the arrays
+ * holding them grow by doubling) they are sorted and appended as one run
+ * to an unlinked temporary file, and rows_flush() then merges the runs,
+ * reading each through a buffer of its own with only its head row in
+ * row_buf. Each spilled run hands its names and keys back at once. Column
+ * widths are widened as rows come in, as always, so they are final before
+ * the first line goes out.
+ */
+struct run_record {
+  struct row row;
+  struct sort_item item;
+  uint32_t name_len, key_len; // with the NUL; followed by the name and key
+};
+
+struct run {
+  off_t pos, end; // the part of the run not yet read into buf
+  char * buf;
+  size_t start, len; // the unused bytes in buf
+};
+
+static _Thread_local struct {
+  int fd; // -1 while nothing has been spilled
+  off_t size;
+  struct run * runs;
+  size_t count, cap;
+  size_t key_max; // longest key spilled, NUL included
+  char * names, * keys; // the names and keys of the run heads, while merging
+  bool unavailable; // no temporary file could be made; don't try again
+  struct outbuf out;
+} spill = {
+  .fd = -1, .out = {
+    .data = NULL, .len = 0, .cap = 0, .fd = -1
+  }
+};
+
+/* rows_bytes(): about what the rows collected take up, keys included */
+static size_t rows_bytes(void) {
+  size_t names = row_buf.names.used * (keyed_names() ? 4 : 1);
+  return row_buf.count * (ROW_BYTES + 2 * sizeof(struct sort_item)) + names;
+}
+
+/*
+ * spill_open(): an unlinked temporary file in $TMPDIR (or /tmp) for the
+ * runs. O_TMPFILE where the filesystem has it (overlayfs only does on
+ * recent kernels), mkostemp() and unlink() where not. -1 if neither works.
+ */
+static int spill_open(void) {
+  const char * tmpdir = getenv("TMPDIR");
+  if (tmpdir == NULL || * tmpdir == '\0') {
+    tmpdir = "/tmp";
+  }
+  int fd = open(tmpdir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (fd != -1 || (errno != EOPNOTSUPP && errno != EISDIR)) {
+    return fd;
+  }
+
+  char * path = join_path(tmpdir, "ls-XXXXXX");
+  fd = mkostemp(path, O_CLOEXEC);
+  if (fd != -1) {
+    unlink(path);
+  }
+  free(path);
+  return fd;
+}
+
+/* spill_run(): sort the rows collected and write them out as the next run */
+static void spill_run(void) {
+  if (spill.fd == -1) {
+    spill.fd = spill_open();
+    if (spill.fd == -1) {
+      // better a listing that takes the memory than none at all
+      perror("ls: cannot create temporary file, sorting in memory");
+      spill.unavailable = true;
+      return;
+    }
+    spill.size = 0;
+    spill.key_max = 0;
+    spill.out.fd = spill.fd;
+  }
+  sort_rows();
+
+  off_t start = spill.size;
+  struct outbuf * saved = output;
+  output = & spill.out;
+  for (size_t index = 0; index < row_buf.count; index++) {
+    struct run_record rec = {
+      .item = sort_items[index]
+    };
+    row_get(sort_items[index].row, & rec.row);
+    rec.name_len = (uint32_t) strlen(rec.row.name) + 1;
+    rec.key_len = keyed_names() ? (uint32_t) strlen(rec.row.key) + 1 : 0;
+    out_mem( & rec, sizeof(rec));
+    out_mem(rec.row.name, rec.name_len);
+    if (rec.key_len != 0) {
+      out_mem(rec.row.key, rec.key_len);
+    }
+    spill.size += (off_t)(sizeof(rec) + rec.name_len + rec.key_len);
+    if (rec.key_len > spill.key_max) {
+      spill.key_max = rec.key_len;
+    }
+  }
+  out_flush( & spill.out);
+  output = saved;
+
+  if (spill.count == spill.cap) {
+    spill.cap = spill.cap ? spill.cap * 2 : 16;
+    spill.runs = xrealloc(spill.runs, spill.cap * sizeof( * spill.runs));
+  }
+  spill.runs[spill.count++] = (struct run) {
+    .pos = start, .end = spill.size, .buf = NULL, .start = 0, .len = 0
+  };
+  rows_clear();
+}
+
+/* run_fill(): get `n` bytes of `run` into its buffer, `cap` big. False at its end. */
+static bool run_fill(struct run * run, size_t n, size_t cap) {
+  if (run -> len - run -> start >= n) {
+    return true;
+  }
+  memmove(run -> buf, run -> buf + run -> start, run -> len - run -> start);
+  run -> len -= run -> start;
+  run -> start = 0;
+  while (run -> len < n && run -> pos < run -> end) {
+    size_t want = cap - run -> len;
+    if ((off_t) want > run -> end - run -> pos) {
+      want = (size_t)(run -> end - run -> pos);
+    }
+    ssize_t got = pread(spill.fd, run -> buf + run -> len, want, run -> pos);
+    if (got <= 0) {
+      if (got == -1 && errno == EINTR) {
+        continue;
+      }
+      perror("ls: cannot read temporary file");
+      exit(64);
+    }
+    run -> len += (size_t) got;
+    run -> pos += got;
+  }
+  return run -> len >= n;
+}
+
+/*
+ * run_next(): move the next row of run `k` into row slot `k` and its sort
+ * item into `item`. False once the run is used up.
+ */
+static bool run_next(size_t k, struct sort_item * item, size_t cap) {
+  struct run * run = & spill.runs[k];
+  struct run_record rec;
+  if (!run_fill(run, sizeof(rec), cap)) {
+    return false;
+  }
+  memcpy( & rec, run -> buf + run -> start, sizeof(rec));
+  run_fill(run, sizeof(rec) + rec.name_len + rec.key_len, cap);
+  const char * p = run -> buf + run -> start + sizeof(rec);
+  run -> start += sizeof(rec) + rec.name_len + rec.key_len;
+
+  rec.row.name = memcpy(spill.names + k * (NAME_MAX + 1), p, rec.name_len);
+  if (rec.key_len != 0) {
+    rec.row.key = memcpy(spill.keys + k * spill.key_max, p + rec.name_len, rec.key_len);
+  }
+  row_put(k, & rec.row);
+  * item = rec.item;
+  item -> row = (uint32_t) k;
+  return true;
+}
+
+static void emit_row(int dirfd, char * dirname, size_t index,
+  struct dir_stack * stack);
+
+/* merge_runs(): write out the spilled runs, merged into one listing */
+static void merge_runs(int dirfd, char * dirname, struct dir_stack * stack) {
+  size_t k = spill.count;
+  rows_room(k);
+  spill.names = arena_room( & row_buf.names, k * (NAME_MAX + 1));
+  arena_take( & row_buf.names, k * (NAME_MAX + 1));
+  spill.keys = arena_room( & row_buf.keys, k * spill.key_max);
+  arena_take( & row_buf.keys, k * spill.key_max);
+  sort_items_room(k);
+
+  // the limit's other half goes to the read buffers, each at least a row
+  size_t cap = memory_limit / 2 / k;
+  size_t row_max = sizeof(struct run_record) + NAME_MAX + 1 + spill.key_max;
+  if (cap < 2 * row_max) {
+    cap = 2 * row_max;
+  }
+  size_t n = 0;
+  for (size_t run = 0; run < k; run++) {
+    spill.runs[run].buf = xrealloc(NULL, cap);
+    if (run_next(run, & sort_items[n], cap)) {
+      heap_sift_up(n++, -1);
+    }
+  }
+
+  while (n > 0) {
+    size_t run = sort_items[0].row;
+    emit_row(dirfd, dirname, run, stack);
+    if (!run_next(run, & sort_items[0], cap)) {
+      sort_items[0] = sort_items[--n];
+    }
+    heap_sift_down(0, n, -1);
+  }
+
+  for (size_t run = 0; run < k; run++) {
+    free(spill.runs[run].buf);
+  }
+  free(spill.out.data);
+  spill.out = (struct outbuf) {
+    .data = NULL, .len = 0, .cap = 0, .fd = -1
+  };
+  close(spill.fd);
+  spill.fd = -1;
+  spill.count = 0;
+}
+
+/* emit_row(): write row `index` of directory `dirfd`, or the error it holds */
+static void emit_row(int dirfd, char * dirname, size_t index,
+  struct dir_stack * stack) {
+  char * name = row_buf.name[index];
+  mode_t mode = row_buf.mode[index];
+  if (row_buf.stat_errno[index] != 0) {
+    errno = row_buf.stat_errno[index];
+    handle_entry_error("cannot access", dirname, name);
+    return;
+  }
+
+  if (row_buf.list_long) {
+    struct row r;
+    row_get(index, & r);
+    render_row(dirfd, & r, name, & row_buf.widths);
+  } else {
+    out_str(name);
+    if (S_ISDIR(mode) && !is_dot_or_dotdot(name)) {
+      out_char('/');
+    }
+    out_char('\n');
+  }
+
+  if (stack != NULL && S_ISDIR(mode) && !is_dot_or_dotdot(name)) {
+    push_pending(stack, name);
+  }
+}
+
+/*
+ * rows_flush(): sort and render the rows collected so far from directory
+ * `dirfd`, pushing its subdirectories onto `stack` (if given) in that order.
+ */
+static void rows_flush(int dirfd, char * dirname, struct dir_stack * stack) {
+  if (limit_heap() && row_buf.list_long) {
+    // only now is it known which rows are listed
+    for (size_t index = 0; index < row_buf.count; index++) {
+      struct row r;
+      row_get(index, & r);
+      if (r.stat_errno == 0) {
+        widen_row( & r, & row_buf.widths);
+      }
+    }
+  }
+
+  if (spill.count > 0) {
+    if (row_buf.count > 0) {
+      spill_run();
+    }
+    merge_runs(dirfd, dirname, stack);
+    rows_clear();
+    return;
+  }
+
+  bool sorted = sort_by != SORT_NONE && row_buf.count > 1;
+  if (sorted) {
+    sort_rows();
+  }
+
+  for (size_t index = 0; index < row_buf.count; index++) {
+    emit_row(dirfd, dirname, sorted ? sort_items[index].row : index, stack);
+  }
+  rows_clear();
+}
+
+/* store_row(): put the row of `e` in slot `index`, its name in row_buf.names */
+static void store_row(size_t index, struct entry * e, struct col_widths * widths) {
+  rows_room(index + 1);
+  struct row r;
+  r.name = arena_copy( & row_buf.names, e -> name, strlen(e -> name) + 1);
+  r.key = NULL;
+
+  if (!e -> have_stat && e -> stat_errno != 0) {
+    // sorted by name and type only
+    r = (struct row) {
+      .name = r.name, .key = NULL, .stat_errno = e -> stat_errno,
+      .mode = DTTOIF(e -> d_type)
+    };
+  } else {
+    fill_row( & r, e, widths);
+  }
+  row_put(index, & r);
+}
+
+/*
+ * --limit on a sorted listing: only the first list_limit rows in listing
+ * order are kept. While the directory is read, sort_items is a max-heap of
+ * them, its top the row that would be listed last; each new row either
+ * takes that one's place or is dropped straight away, so rows, names and
+ * keys stay in proportion to the limit rather than the directory. Owners
+ * and column widths wait until rows_flush() knows which rows made it.
+ */
+
+/*
+ * compact_names(): drop the names (and keys) of evicted rows, once they take
+ * up more room than the rows still held, by moving the live ones to fresh
+ * arenas
+ */
+static void compact_names(void) {
+  if (row_buf.names.used < 65536 || row_buf.names_dead * 2 < row_buf.names.used) {
+    return;
+  }
+  struct arena names = {
+    .chunk = NULL, .next = NULL, .end = NULL, .used = 0
+  }, keys = names;
+  for (size_t index = 0; index < row_buf.count; index++) {
+    row_buf.name[index] = arena_copy( & names, row_buf.name[index],
+      strlen(row_buf.name[index]) + 1);
+    if (keyed_names()) {
+      row_buf.key[index] = arena_copy( & keys, row_buf.key[index],
+        strlen(row_buf.key[index]) + 1);
+    }
+  }
+  arena_free( & row_buf.names);
+  arena_free( & row_buf.keys);
+  row_buf.names = names;
+  row_buf.keys = keys;
+  row_buf.names_dead = 0;
+}
+
+/* add_limited_row(): offer the row of `e` to the --limit heap */
+static void add_limited_row(struct entry * e) {
+  sort_items_room(row_buf.count + 1);
+
+  // the newcomer goes in the slot past the heap until we know it stays
+  size_t slot = row_buf.count;
+  struct sort_item item;
+  store_row(slot, e, NULL);
+  make_sort_item( & item, slot);
+  if (row_buf.count < list_limit) {
+    sort_items[row_buf.count++] = item;
+    heap_sift_up(slot, 1);
+    return;
+  }
+
+  if (compare_items( & item, & sort_items[0]) >= 0) {
+    // listed after everything kept so far: forget it
+    if (keyed_names()) {
+      arena_unwind( & row_buf.keys, row_buf.key[slot]);
+    }
+    arena_unwind( & row_buf.names, row_buf.name[slot]);
+    return;
+  }
+  size_t evicted = sort_items[0].row;
+  row_buf.names_dead += strlen(row_buf.name[evicted]) + 1;
+  struct row r;
+  row_get(slot, & r);
+  row_put(evicted, & r);
+  item.row = (uint32_t) evicted;
+  sort_items[0] = item;
+  heap_sift_down(0, row_buf.count, 1);
+  compact_names();
+}
+
+/*
+ * add_row(): queue the row of `e`, or its failed lookup, for rows_flush().
+ * Whatever lookup the listing needs has been done already.
+ */
+static void add_row(struct entry * e) {
+  if (limit_heap()) {
+    add_limited_row(e);
+    return;
+  }
+  store_row(row_buf.count, e, row_buf.list_long ? & row_buf.widths : NULL);
+  row_buf.count++;
+  if (memory_limit != 0 && sort_by != SORT_NONE && !spill.unavailable &&
+    rows_bytes() > memory_limit / 2) {
+    spill_run();
+  }
+}
+
+/* list_file():
+ * implement the logic for listing a single file.
  * This function takes:
-    printf("");
- *    - dirname: the name of the directory
- *    - list_long: should the directory be listed in long mode?
- *    - list_all: are we in "-a" mode?
- *    - recursive: are we supposed to list sub-directories?
+ *   - dirfd: the directory `e -> name` is looked up in (AT_FDCWD for
+ *   command-line arguments).
+ *   - dirname: that directory's path, for messages (NULL for arguments).
+ *   - e: the entry record; its name, and whatever metadata is already known.
+ *   Short listings only need the type to decide on the trailing "/".
+ *   - list_long: a flag indicated whether the printout should be in
+ *   long mode.
+ */
+void list_file(int dirfd, char * dirname, struct entry * e, bool list_long) {
+  if (count_only) {
+    file_count++;
+    return;
+  }
+
+  char * name = e -> name;
+
+  if (list_long) {
+    if (!stat_entry(dirfd, dirname, e)) {
+      return;
+    }
+    // a file named on the command line, or any entry under --stream: a
+    // table of one row
+    struct row r;
+    struct col_widths widths = min_widths;
+    fill_row( & r, e, & widths);
+    render_row(dirfd, & r, name, & widths);
+  } else {
+    if (e -> d_type == DT_UNKNOWN && !stat_entry(dirfd, dirname, e)) {
+      return;
+    }
+
+    out_str(name);
+
+    // making sure if it isn't "." or ".." case
+    if (e -> d_type == DT_DIR && strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+      out_char('/');
+    }
+
+    out_char('\n');
+  }
+}
+
+/*
+ * struct dir_node: a directory whose subdirectories are still waiting on the
+ * work stack. It keeps the directory's fd open so they can be opened with
+ * openat(), and its path so theirs can be built. `pending` counts the
+ * children still on the stack; the last one to be opened frees the node.
+ */
+struct dir_node {
+  int fd; // -1 if we ran short of descriptors, see open_subdir()
+  char * path;
+  atomic_size_t pending; // children may be opened by different -j workers
+};
+
+/* struct pending_dir: a subdirectory that has been found but not listed yet. */
+struct pending_dir {
+  struct dir_node * parent; // NULL for the directory named on the command line
+  char * name;
+};
+
+/*
+ * struct dir_stack: the traversal frontier for -R. It lives on the heap and
+ * only ever holds subdirectories that have been seen but not yet listed, so
+ * its size follows the tree's actual fan-out rather than its depth.
+ */
+struct dir_stack {
+  struct pending_dir * items;
+  size_t count;
+  size_t cap;
+};
+
+// Directory fds held open by dir_nodes, and how many we allow ourselves (set
+// from RLIMIT_NOFILE in main()). Past the limit a node gives up its fd and
+// its children are opened by full path instead.
+static atomic_size_t open_dir_fds = 0;
+static size_t max_dir_fds = 256;
+
+static void push_item(struct dir_stack * stack, struct pending_dir item) {
+  if (stack -> count == stack -> cap) {
+    stack -> cap = stack -> cap ? stack -> cap * 2 : 64;
+    stack -> items = xrealloc(stack -> items, stack -> cap * sizeof( * stack -> items));
+  }
+  stack -> items[stack -> count++] = item;
+}
+
+static void push_pending(struct dir_stack * stack, const char * name) {
+  char * copy = strdup(name);
+  if (copy == NULL) {
+    perror("ls");
+    exit(64);
+  }
+  push_item(stack, (struct pending_dir) {
+    .parent = NULL, .name = copy
+  });
+}
+
+/*
+ * open_subdir(): open the directory `item` refers to, whose full path is
+ * `path`, and drop its reference on the parent node. Returns the fd, or -1
+ * with errno set.
+ */
+static int open_subdir(struct pending_dir * item, char * path) {
+  struct dir_node * parent = item -> parent;
+  int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+  int fd;
+
+  if (parent == NULL) {
+    fd = openat(AT_FDCWD, item -> name, flags);
+  } else if (parent -> fd != -1) {
+    fd = openat(parent -> fd, item -> name, flags);
+  } else {
+    fd = openat(AT_FDCWD, path, flags);
+  }
+  int saved_errno = errno;
+
+  if (parent != NULL && atomic_fetch_sub( & parent -> pending, 1) == 1) {
+    if (parent -> fd != -1) {
+      close(parent -> fd);
+      atomic_fetch_sub( & open_dir_fds, 1);
+    }
+    free(parent -> path);
+    free(parent);
+  }
+  free(item -> name);
+
+  errno = saved_errno;
+  return fd;
+}
+
+// Entries of the getdents64 fill being listed, reused from one fill to the
+// next so that stat_batch() can look them all up at once.
+static _Thread_local struct entry * batch = NULL;
+static _Thread_local size_t batch_cap = 0;
+
+/*
+ * Leaf pruning, as find(1) does it. On filesystems that keep the classic
+ * convention a directory's st_nlink is 2 plus its number of subdirectories,
+ * so once that many subdirectories have turned up, whatever is left can't be
+ * one and needs no lookup just to learn its type. This only matters where
+ * getdents64 reports DT_UNKNOWN, and only if the filesystem is one known to
+ * keep the convention (btrfs reports 1, overlayfs and many network
+ * filesystems can't be trusted).
+ */
+struct leaf_prune {
+  bool checked; // st_nlink and the filesystem have been looked at
+  bool usable; // the filesystem keeps the convention
+  nlink_t subdirs; // st_nlink - 2
+  nlink_t seen; // subdirectories found so far, hidden ones included
+};
+
+static bool fs_counts_subdirs(int fd, dev_t dev) {
+  // the answer is per filesystem, so remember it for the last few devices
+  static _Thread_local struct {
+    dev_t dev;
+    bool ok;
+  } cache[8];
+  static _Thread_local size_t cached = 0;
+
+  for (size_t index = 0; index < cached && index < 8; index++) {
+    if (cache[index].dev == dev) {
+      return cache[index].ok;
+    }
+  }
+
+  struct statfs sfs;
+  bool ok = false;
+  if (fstatfs(fd, & sfs) == 0) {
+    switch ((unsigned long) sfs.f_type) {
+    case EXT4_SUPER_MAGIC: // also ext2 and ext3
+    case XFS_SUPER_MAGIC:
+    case TMPFS_MAGIC:
+    case REISERFS_SUPER_MAGIC:
+    case 0x3153464a: // JFS
+      ok = true;
+      break;
+    }
+  }
+  size_t slot = cached++ % 8;
+  cache[slot].dev = dev;
+  cache[slot].ok = ok;
+  return ok;
+}
+
+static void leaf_check(int fd, struct leaf_prune * lp) {
+  struct stat sb;
+  lp -> checked = true;
+  lp -> usable = fstat(fd, & sb) == 0 && sb.st_nlink >= 2 &&
+    fs_counts_subdirs(fd, sb.st_dev);
+  if (lp -> usable) {
+    lp -> subdirs = sb.st_nlink - 2;
+  }
+}
+
+/* whether every subdirectory of the directory has already been seen */
+static bool leaf_done(int fd, struct leaf_prune * lp) {
+  if (!lp -> checked) {
+    leaf_check(fd, lp);
+  }
+  return lp -> usable && lp -> seen >= lp -> subdirs;
+}
+
+/*
+ * list_entries(): list the entries of the open directory `fd`, whose path is
+ * `dirname`. With `recursive`, the names of its subdirectories are pushed
+ * onto `stack` in the order they were listed. --stream, which never
+ * collects rows, passes no stack and only gets their number back.
+ */
+static size_t list_entries(int fd, char * dirname, bool list_long, bool list_all,
+  bool recursive, struct dir_stack * stack) {
+  struct dir_reader reader = {
+    .fd = fd, .buf = NULL, .size = 0, .pos = 0, .len = 0
+  };
+  int read_errno = 0;
+  bool more = true;
+  size_t subdirs = 0;
+
+  // short listings and recursion only need the entry type, which readdir()
+  // already hands us in d_type; long listings and -t/-S need the metadata,
+  // and that one lookup is shared with the recursion check below.
+  bool need_type = recursive || (!count_only && !list_long);
+  bool need_all = !count_only && (list_long || sort_by == SORT_TIME ||
+    sort_by == SORT_SIZE);
+
+  // long and sorted listings collect the whole directory as rows first;
+  // unsorted short ones, and everything under --stream, are printed as
+  // they are read
+  bool collect = !count_only && !stream && (list_long || sort_by != SORT_NONE);
+
+  // --limit on an unsorted listing: the first entries read are the ones
+  // listed, so the rest of the directory need not be read at all
+  bool stop_early = list_limit != 0 && !count_only && sort_by == SORT_NONE;
+  size_t listed = 0;
+
+  // only type-only listings can skip lookups; long ones need the metadata
+  bool prune = need_type && !need_all;
+  struct leaf_prune lp = {
+    .checked = false, .usable = false, .subdirs = 0, .seen = 0
+  };
+  if (collect) {
+    rows_begin(list_long);
+  }
+
+  while (more) {
+    // Take one getdents64 fill at a time: the names point into dirent_buf,
+    // so they are looked up and listed before the next refill.
+    size_t n = 0;
+    bool unknown = false;
+    do {
+      struct linux_dirent64 * entry = dir_reader_next( & reader);
+      if (entry == NULL) {
+        read_errno = errno;
+        more = false;
+        break;
+      }
+      if (entry -> d_type == DT_DIR && !is_dot_or_dotdot(entry -> d_name)) {
+        lp.seen++;
+      }
+      // skip hidden files
+      if (!list_all && entry -> d_name[0] == '.') {
+        continue; // go to next file
+      }
+
+      if (n == batch_cap) {
+        batch_cap = batch_cap ? batch_cap * 2 : 1024;
+        batch = xrealloc(batch, batch_cap * sizeof( * batch));
+      }
+      batch[n].name = entry -> d_name;
+      batch[n].d_type = entry -> d_type;
+      batch[n].have_stat = false;
+      batch[n].stat_errno = 0;
+      unknown |= entry -> d_type == DT_UNKNOWN;
+      n++;
+    } while (reader.pos < reader.len);
+
+    // a leaf, or one whose subdirectories have all turned up: nothing left
+    // in this fill needs a lookup
+    if (prune && unknown && leaf_done(fd, & lp)) {
+      for (size_t index = 0; index < n; index++) {
+        if (batch[index].d_type == DT_UNKNOWN) {
+          batch[index].d_type = DT_REG; // all we need to know: not a directory
+        }
+      }
+    }
+
+    stat_batch(fd, batch, n, need_all, need_type);
+
+    for (size_t index = 0; index < n; index++) {
+      struct entry * e = & batch[index];
+      bool found = true;
+      if (need_all) {
+        found = lookup_entry(fd, e);
+      } else if (need_type && e -> d_type == DT_UNKNOWN) {
+        if (prune && leaf_done(fd, & lp)) {
+          e -> d_type = DT_REG;
+        } else {
+          found = lookup_entry(fd, e);
+        }
+      }
+      // in type-only listings, have_stat means d_type didn't tell us
+      if (prune && e -> have_stat && e -> d_type == DT_DIR &&
+        !is_dot_or_dotdot(e -> name)) {
+        lp.seen++;
+      }
+
+      if (collect) {
+        // written, and queued if it is a directory, by rows_flush()
+        if (sort_by == SORT_NONE && row_buf.count == ROW_BATCH) {
+          rows_flush(fd, dirname, recursive ? stack : NULL);
+        }
+        add_row(e);
+        if (stop_early && ++listed == list_limit) {
+          more = false;
+          break;
+        }
+        continue;
+      }
+      if (stop_early && ++listed > list_limit) {
+        more = false;
+        break;
+      }
+      if (!found) {
+        stat_entry(fd, dirname, e); // reports the error
+        continue;
+      }
+
+      // list the file
+      list_file(fd, dirname, e, list_long);
+
+      if (recursive) {
+        // skipping "." and ".."
+        if (is_dot_or_dotdot(e -> name)) {
+          continue;
+        }
+
+        if (e -> d_type == DT_DIR) {
+          if (stack != NULL) {
+            push_pending(stack, e -> name);
+          }
+          subdirs++;
+        }
+      }
+    }
+  }
+
+  if (collect) {
+    rows_flush(fd, dirname, recursive ? stack : NULL);
+    rows_end(ROW_KEEP);
+  }
+  if (read_errno != 0) {
+    errno = read_errno;
+    handle_error("Error reading directory", dirname);
+  }
+  return subdirs;
+}
+
+/*
+ * list_pending(): list the directory `item` refers to, preceded by its "-R"
+ * header. Its subdirectories are pushed onto `stack` so that popping them
+ * from the top yields them in listing order.
  */
-void list_dir(char * dirname, bool list_long, bool list_all, bool recursive) {
+static void list_pending(struct pending_dir * item, bool list_long,
+  bool list_all, bool recursive, struct dir_stack * stack) {
+  bool top = item -> parent == NULL;
+  char * path = join_path(top ? NULL : item -> parent -> path, item -> name);
+
+  if (!top) {
+    out_char('\n');
+  }
   // checking if recursive flag is set
   if (recursive) {
-    printf("%s:\n", dirname);
+    out_str(path);
+    out_str(":\n");
+  }
+
+  // open dir; everything below is looked up relative to its fd, which stays
+  // open until the subdirectories have been listed
+  int fd = open_subdir(item, path);
+  if (fd == -1) {
+    handle_error("Error opening directory", path);
+    free(path);
+    return;
   }
 
-  // open dir
-  DIR * dir = opendir(dirname);
-  if (dir == NULL) {
-    handle_error("Error opening directory", dirname);
+  size_t first = stack -> count;
+  list_entries(fd, path, list_long, list_all, recursive, stack);
+  size_t found = stack -> count - first;
+  out_dir_done();
+
+  if (found == 0) {
+    close(fd);
+    free(path);
     return;
   }
 
-  struct dirent * entry;
-  char subdir_list[1024][256]; // will be storing subdir names
-  int subdir_count = 0; // count of how many subdirs stored
+  // the children are popped in reverse, so flip them to keep listing order
+  struct dir_node * node = xrealloc(NULL, sizeof( * node));
+  node -> path = path;
+  node -> pending = found;
+  node -> fd = fd;
+  if (atomic_fetch_add( & open_dir_fds, 1) >= max_dir_fds) {
+    atomic_fetch_sub( & open_dir_fds, 1);
+    close(fd);
+    node -> fd = -1;
+  }
+  for (size_t lo = first, hi = stack -> count - 1; lo < hi; lo++, hi--) {
+    struct pending_dir tmp = stack -> items[lo];
+    stack -> items[lo] = stack -> items[hi];
+    stack -> items[hi] = tmp;
+  }
+  for (size_t index = first; index < stack -> count; index++) {
+    stack -> items[index].parent = node;
+  }
+}
+
+/*
+ * Parallel -R (-j N): every worker owns a deque of pending directories. It
+ * pushes the subdirectories it finds onto the top of its own deque and pops
+ * from there too, so it walks its part of the tree depth-first; idle workers
+ * steal from the bottom of someone else's deque, which is where the oldest
+ * and usually largest subtrees are.
+ *
+ * Output stays byte-identical to the serial walk. Each directory gets an
+ * out_block that it is rendered into, and the blocks form the same tree as
+ * the directories. The calling thread acts as the sequencer: it walks that
+ * tree depth-first, in listing order, and writes each block once it is done.
+ * Finished blocks waiting for their turn are bounded by --reorder-buffer;
+ * past that, workers stop picking up new directories until the sequencer
+ * catches up. The sequencer never waits on a directory nobody has started:
+ * it claims and lists such a directory itself, straight to stdout, so the
+ * walk always makes progress.
+ */
+enum block_state {
+  BLOCK_PENDING, // on some deque, not started
+  BLOCK_CLAIMED, // being listed
+  BLOCK_DONE // rendered; buf and children are valid
+};
+
+struct out_block {
+  struct pending_dir item;
+  _Atomic int state; // enum block_state
+  atomic_int refs; // one for the tree, one for the deque it sits on
+  char * buf; // rendered output; NULL if the sequencer wrote it directly
+  size_t len;
+  struct out_block ** children; // subdirectory blocks, in listing order
+  size_t nchildren;
+};
+
+struct block_deque {
+  struct out_block ** items; // items [head, count) are queued
+  size_t head;
+  size_t count;
+  size_t cap;
+};
+
+struct worker {
+  pthread_t thread;
+  size_t id;
+  pthread_mutex_t lock; // protects deque
+  struct block_deque deque;
+};
+
+static struct {
+  struct worker * workers;
+  size_t nworkers;
+  bool list_long, list_all, recursive;
+
+  pthread_mutex_t lock; // protects the fields below and block state changes
+  pthread_cond_t wake; // new work, or the walk is finished
+  pthread_cond_t done; // a block became BLOCK_DONE
+  pthread_cond_t room; // the sequencer freed buffered output
+  unsigned long generation; // bumped whenever new work is pushed
+  size_t buffered; // bytes in done blocks not yet written
+  bool finished;
+} pool = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .wake = PTHREAD_COND_INITIALIZER,
+  .done = PTHREAD_COND_INITIALIZER,
+  .room = PTHREAD_COND_INITIALIZER
+};
+
+static void drop_block(struct out_block * b) {
+  if (atomic_fetch_sub( & b -> refs, 1) == 1) {
+    free(b -> buf);
+    free(b -> children);
+    free(b);
+  }
+}
+
+static struct out_block * new_block(struct pending_dir item) {
+  struct out_block * b = xrealloc(NULL, sizeof( * b));
+  b -> item = item;
+  atomic_init( & b -> state, BLOCK_PENDING);
+  atomic_init( & b -> refs, 2);
+  b -> buf = NULL;
+  b -> len = 0;
+  b -> children = NULL;
+  b -> nchildren = 0;
+  return b;
+}
+
+static bool claim_block(struct out_block * b) {
+  int expected = BLOCK_PENDING;
+  return atomic_compare_exchange_strong( & b -> state, & expected, BLOCK_CLAIMED);
+}
 
-  while ((entry = readdir(dir)) != NULL) {
-    // skip hidden files
-    if (!list_all && entry -> d_name[0] == '.') {
-      continue; // go to next file
+static void deque_push(struct worker * w, struct out_block * b) {
+  struct block_deque * d = & w -> deque;
+  if (d -> count == d -> cap) {
+    if (d -> head > 0) {
+      // reclaim the slots thieves have emptied before growing
+      memmove(d -> items, d -> items + d -> head,
+        (d -> count - d -> head) * sizeof( * d -> items));
+      d -> count -= d -> head;
+      d -> head = 0;
+    } else {
+      d -> cap = d -> cap ? d -> cap * 2 : 64;
+      d -> items = xrealloc(d -> items, d -> cap * sizeof( * d -> items));
     }
+  }
+  d -> items[d -> count++] = b;
+}
 
-    // building the path here
-    char fullpath[1024];
-    snprintf(fullpath, sizeof(fullpath), "%s/%s", dirname, entry -> d_name);
+/* take a block from the top of our own deque, or the bottom of another's */
+static struct out_block * take_work(struct worker * w) {
+  for (size_t offset = 0; offset < pool.nworkers; offset++) {
+    struct worker * victim = & pool.workers[(w -> id + offset) % pool.nworkers];
+    struct block_deque * d = & victim -> deque;
+    struct out_block * b = NULL;
 
-    // list the file
-    list_file(fullpath, entry -> d_name, list_long);
+    pthread_mutex_lock( & victim -> lock);
+    if (d -> count > d -> head) {
+      b = victim == w ? d -> items[--d -> count] : d -> items[d -> head++];
+    }
+    if (d -> count == d -> head) {
+      d -> count = d -> head = 0;
+    }
+    pthread_mutex_unlock( & victim -> lock);
 
-    if (recursive) {
-      // skipping "." and ".."
-      if (strcmp(entry -> d_name, ".") == 0 || strcmp(entry -> d_name, "..") == 0) {
+    if (b != NULL) {
+      return b;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * run_block(): list the directory of a block claimed by this thread, then
+ * queue its subdirectories on `w`'s deque and publish the block. Output goes
+ * to `output`, which the caller has pointed at the block or at stdout_buf.
+ */
+static void run_block(struct out_block * b, struct worker * w,
+  struct dir_stack * children) {
+  list_pending( & b -> item, pool.list_long, pool.list_all, pool.recursive,
+    children);
+
+  // children hold the subdirectories in pop order, i.e. reversed
+  size_t found = children -> count;
+  b -> nchildren = found;
+  if (found > 0) {
+    b -> children = xrealloc(NULL, found * sizeof( * b -> children));
+    pthread_mutex_lock( & w -> lock);
+    for (size_t index = 0; index < found; index++) {
+      struct out_block * child = new_block(children -> items[index]);
+      b -> children[found - 1 - index] = child;
+      deque_push(w, child);
+    }
+    pthread_mutex_unlock( & w -> lock);
+    children -> count = 0;
+  }
+}
+
+static void * worker_main(void * arg) {
+  struct worker * w = arg;
+  struct dir_stack children = {
+    .items = NULL, .count = 0, .cap = 0
+  };
+
+  pthread_mutex_lock( & pool.lock);
+  while (!pool.finished) {
+    // backpressure: leave new directories alone until the sequencer has
+    // written enough of what is already buffered
+    if (pool.buffered > reorder_buffer_size) {
+      pthread_cond_wait( & pool.room, & pool.lock);
+      continue;
+    }
+
+    unsigned long seen = pool.generation;
+    pthread_mutex_unlock( & pool.lock);
+
+    struct out_block * b = take_work(w);
+    if (b == NULL) {
+      pthread_mutex_lock( & pool.lock);
+      while (!pool.finished && pool.generation == seen) {
+        pthread_cond_wait( & pool.wake, & pool.lock);
+      }
+      continue;
+    }
+    if (!claim_block(b)) {
+      // the sequencer got to it first
+      drop_block(b);
+      pthread_mutex_lock( & pool.lock);
+      continue;
+    }
+
+    struct outbuf rendered = {
+      .data = NULL, .len = 0, .cap = 0, .fd = -1
+    };
+    output = & rendered;
+    run_block(b, w, & children);
+    output = NULL;
+
+    pthread_mutex_lock( & pool.lock);
+    b -> buf = rendered.data;
+    b -> len = rendered.len;
+    atomic_store( & b -> state, BLOCK_DONE);
+    pool.buffered += rendered.len;
+    pthread_cond_signal( & pool.done);
+    if (b -> nchildren > 0) {
+      pool.generation++;
+      pthread_cond_broadcast( & pool.wake);
+    }
+    drop_block(b);
+  }
+  pthread_mutex_unlock( & pool.lock);
+
+  free(children.items);
+  free(dirent_buf);
+  dirent_buf = NULL;
+  free(batch);
+  batch = NULL;
+  batch_cap = 0;
+  rows_end(0);
+  uring_teardown();
+  return NULL;
+}
+
+/*
+ * sequence_blocks(): the sequencer. Writes the block tree rooted at `root`
+ * to stdout in depth-first listing order, the order the serial walk prints.
+ */
+static void sequence_blocks(struct out_block * root) {
+  struct frame {
+    struct out_block * block;
+    size_t next_child;
+  } * frames = NULL;
+  size_t depth = 0, cap = 0;
+  struct dir_stack children = {
+    .items = NULL, .count = 0, .cap = 0
+  };
+
+  struct out_block * b = root;
+  for (;;) {
+    if (claim_block(b)) {
+      // nobody has started on it: list it ourselves, straight to stdout
+      run_block(b, & pool.workers[0], & children);
+      pthread_mutex_lock( & pool.lock);
+      atomic_store( & b -> state, BLOCK_DONE);
+      if (b -> nchildren > 0) {
+        pool.generation++;
+        pthread_cond_broadcast( & pool.wake);
+      }
+      pthread_mutex_unlock( & pool.lock);
+    } else {
+      pthread_mutex_lock( & pool.lock);
+      while (atomic_load( & b -> state) != BLOCK_DONE) {
+        pthread_cond_wait( & pool.done, & pool.lock);
+      }
+      pthread_mutex_unlock( & pool.lock);
+
+      if (b -> len > 0) {
+        out_mem(b -> buf, b -> len);
+        out_dir_done();
+      }
+      pthread_mutex_lock( & pool.lock);
+      pool.buffered -= b -> len;
+      pthread_cond_broadcast( & pool.room);
+      pthread_mutex_unlock( & pool.lock);
+      free(b -> buf);
+      b -> buf = NULL;
+    }
+
+    if (depth == cap) {
+      cap = cap ? cap * 2 : 64;
+      frames = xrealloc(frames, cap * sizeof( * frames));
+    }
+    frames[depth++] = (struct frame) {
+      .block = b, .next_child = 0
+    };
+
+    // move on to the next block in depth-first order
+    b = NULL;
+    while (depth > 0) {
+      struct frame * top = & frames[depth - 1];
+      if (top -> next_child < top -> block -> nchildren) {
+        b = top -> block -> children[top -> next_child++];
+        break;
+      }
+      drop_block(top -> block);
+      depth--;
+    }
+    if (b == NULL) {
+      break;
+    }
+  }
+
+  free(frames);
+  free(children.items);
+}
+
+/*
+ * list_dir_parallel(): list_dir() for -R with more than one job. `jobs`
+ * workers list directories while the calling thread sequences their output;
+ * it returns once the whole tree is written.
+ */
+static void list_dir_parallel(char * dirname, bool list_long, bool list_all,
+  bool recursive) {
+  pool.nworkers = (size_t) jobs;
+  pool.workers = xrealloc(NULL, pool.nworkers * sizeof( * pool.workers));
+  pool.list_long = list_long;
+  pool.list_all = list_all;
+  pool.recursive = recursive;
+  pool.buffered = 0;
+  pool.finished = false;
+
+  for (size_t index = 0; index < pool.nworkers; index++) {
+    struct worker * w = & pool.workers[index];
+    w -> id = index;
+    w -> deque = (struct block_deque) {
+      .items = NULL, .head = 0, .count = 0, .cap = 0
+    };
+    pthread_mutex_init( & w -> lock, NULL);
+  }
+
+  char * name = strdup(dirname);
+  if (name == NULL) {
+    perror("ls");
+    exit(64);
+  }
+  struct out_block * root = new_block((struct pending_dir) {
+    .parent = NULL, .name = name
+  });
+  // the root never sits on a deque; the sequencer claims it right away
+  atomic_store( & root -> refs, 1);
+
+  for (size_t index = 0; index < pool.nworkers; index++) {
+    if (pthread_create( & pool.workers[index].thread, NULL, worker_main,
+        & pool.workers[index]) != 0) {
+      perror("ls");
+      exit(64);
+    }
+  }
+
+  sequence_blocks(root);
+
+  pthread_mutex_lock( & pool.lock);
+  pool.finished = true;
+  pthread_cond_broadcast( & pool.wake);
+  pthread_cond_broadcast( & pool.room);
+  pthread_mutex_unlock( & pool.lock);
+  for (size_t index = 0; index < pool.nworkers; index++) {
+    pthread_join(pool.workers[index].thread, NULL);
+  }
+
+  // whatever is still queued was claimed by the sequencer in the meantime
+  for (size_t index = 0; index < pool.nworkers; index++) {
+    struct block_deque * d = & pool.workers[index].deque;
+    for (size_t slot = d -> head; slot < d -> count; slot++) {
+      drop_block(d -> items[slot]);
+    }
+    pthread_mutex_destroy( & pool.workers[index].lock);
+    free(d -> items);
+  }
+  free(pool.workers);
+  pool.workers = NULL;
+}
+
+/*
+ * --stream: -R without a work stack. While a directory is listed nothing
+ * about its subdirectories is kept; once it is done it is read a second
+ * time, and each subdirectory is descended into as that pass reaches it.
+ * All a level of the walk holds is its fd, a small getdents64 buffer of
+ * its own that the pass carries on from, its length of the path and a few
+ * counts, so memory follows the depth of the tree rather than its size or
+ * fan-out.
+ *
+ * The second pass goes over the same entries as the first, --limit
+ * included, and ends as soon as it has found as many subdirectories as the
+ * first one listed, or leaf pruning says there are no more. Only entries
+ * without a d_type that come before the last subdirectory are looked up
+ * twice.
+ * Past max_dir_fds a level gives up its fd and is reopened by path, at the
+ * d_off it had got to, on the way back up.
+ */
+#define STREAM_LEVEL_BUFFER 16384
+
+struct stream_level {
+  struct dir_reader reader; // fd -1 while given up
+  off_t resume; // where to carry on after reopening
+  size_t path_len;
+  size_t subdirs; // listed by the first pass and not yet descended into
+  size_t listed; // entries the second pass has gone past, for --limit
+  struct leaf_prune lp;
+};
+
+/*
+ * stream_open(): open and list directory `name` in `dirfd`, whose path is
+ * `path`, counting the subdirectories listed into `subdirs`. Returns its
+ * fd, or -1 if it couldn't be opened.
+ */
+static int stream_open(int dirfd, char * path, const char * name, bool top,
+  bool list_long, bool list_all, bool recursive, size_t * subdirs) {
+  if (!top) {
+    out_char('\n');
+  }
+  if (recursive) {
+    out_str(path);
+    out_str(":\n");
+  }
+  int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) {
+    handle_error("Error opening directory", path);
+    return -1;
+  }
+  * subdirs = list_entries(fd, path, list_long, list_all, recursive, NULL);
+  out_dir_done();
+  return fd;
+}
+
+/*
+ * stream_next_subdir(): the next subdirectory `level` has, or NULL once its
+ * second pass is through. Read errors were reported by the first pass.
+ */
+static char * stream_next_subdir(struct stream_level * level, bool list_all) {
+  bool stop_early = list_limit != 0 && !count_only;
+  struct linux_dirent64 * rec;
+  while (level -> subdirs > 0 && !leaf_done(level -> reader.fd, & level -> lp) &&
+    (rec = dir_reader_next( & level -> reader)) != NULL) {
+    bool dot = is_dot_or_dotdot(rec -> d_name);
+    if (rec -> d_type == DT_DIR && !dot) {
+      level -> lp.seen++;
+    }
+    // the entries the first pass listed, as it counted them
+    if (!list_all && rec -> d_name[0] == '.') {
+      continue;
+    }
+    if (stop_early && ++level -> listed > list_limit) {
+      break;
+    }
+    if (dot) {
+      continue;
+    }
+
+    struct entry e = {
+      .name = rec -> d_name, .d_type = rec -> d_type, .have_stat = false, .stat_errno = 0
+    };
+    if (e.d_type == DT_UNKNOWN) {
+      if (!lookup_entry(level -> reader.fd, & e)) {
         continue;
       }
+      if (e.d_type == DT_DIR) {
+        level -> lp.seen++;
+      }
+    }
+    if (e.d_type == DT_DIR) {
+      level -> resume = rec -> d_off;
+      level -> subdirs--;
+      return rec -> d_name;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * stream_level_done(): whether `level` is known to have no subdirectory
+ * left to descend into, without reading it any further
+ */
+static bool stream_level_done(struct stream_level * level) {
+  return level -> subdirs == 0 || (level -> lp.checked && level -> lp.usable &&
+    level -> lp.seen >= level -> lp.subdirs);
+}
+
+static void list_dir_stream(char * dirname, bool list_long, bool list_all,
+  bool recursive) {
+  size_t subdirs;
+  int fd = stream_open(AT_FDCWD, dirname, dirname, true, list_long, list_all,
+    recursive, & subdirs);
+  if (fd == -1) {
+    return;
+  }
+  if (!recursive) {
+    close(fd);
+    return;
+  }
+
+  size_t path_cap = strlen(dirname) + 1;
+  char * path = xrealloc(NULL, path_cap);
+  memcpy(path, dirname, path_cap);
+  struct stream_level * levels = NULL;
+  size_t depth = 0, levels_cap = 0;
+  size_t open_fds = 1;
+
+  for (;;) {
+    if (fd != -1) {
+      // a new level: start its second pass
+      if (depth == levels_cap) {
+        levels_cap = levels_cap ? levels_cap * 2 : 16;
+        levels = xrealloc(levels, levels_cap * sizeof( * levels));
+        for (size_t index = depth; index < levels_cap; index++) {
+          levels[index].reader.buf = NULL;
+        }
+      }
+      struct stream_level * level = & levels[depth++];
+      if (level -> reader.buf == NULL) {
+        level -> reader.buf = xrealloc(NULL, STREAM_LEVEL_BUFFER);
+        level -> reader.size = STREAM_LEVEL_BUFFER;
+      }
+      level -> reader.fd = fd;
+      level -> reader.pos = level -> reader.len = 0;
+      level -> path_len = strlen(path);
+      level -> subdirs = subdirs;
+      level -> listed = 0;
+      level -> lp = (struct leaf_prune) {
+        .checked = false, .usable = false, .subdirs = 0, .seen = 0
+      };
+      if (subdirs > 0) {
+        lseek(fd, 0, SEEK_SET); // the first pass read it to the end
+      }
+    }
+    if (depth == 0) {
+      break;
+    }
 
-      struct stat sb;
-      if (lstat(fullpath, & sb) == 0 && S_ISDIR(sb.st_mode)) {
-        // store directory
-        if (subdir_count < 1024) {
-          strncpy(subdir_list[subdir_count], fullpath, sizeof(subdir_list[0]) - 1);
-          subdir_list[subdir_count][sizeof(subdir_list[0]) - 1] = '\0';
-          subdir_count++;
+    struct stream_level * level = & levels[depth - 1];
+    path[level -> path_len] = '\0';
+    if (level -> reader.fd == -1 && stream_level_done(level)) {
+      // nothing left here; don't reopen it (its path may not even resolve)
+      depth--;
+      fd = -1;
+      continue;
+    }
+    if (level -> reader.fd == -1) {
+      level -> reader.fd = openat(AT_FDCWD, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (level -> reader.fd == -1 || lseek(level -> reader.fd, level -> resume,
+          SEEK_SET) == -1) {
+        handle_error("Error opening directory", path);
+        if (level -> reader.fd != -1) {
+          close(level -> reader.fd);
         }
+        depth--;
+        fd = -1;
+        continue;
       }
+      open_fds++;
+      level -> reader.pos = level -> reader.len = 0;
+    }
+
+    char * name = stream_next_subdir(level, list_all);
+    if (name == NULL) {
+      close(level -> reader.fd);
+      open_fds--;
+      depth--;
+      fd = -1;
+      continue;
     }
-  }
 
-  closedir(dir);
+    size_t name_len = strlen(name);
+    if (level -> path_len + name_len + 2 > path_cap) {
+      path_cap = (level -> path_len + name_len + 2) * 2;
+      path = xrealloc(path, path_cap);
+    }
+    path[level -> path_len] = '/';
+    memcpy(path + level -> path_len + 1, name, name_len + 1);
 
-  if (recursive && subdir_count > 0) {
-    for (int index = 0; index < subdir_count; index++) {
-      printf("\n");
-      list_dir(subdir_list[index], list_long, list_all, recursive);
+    fd = stream_open(level -> reader.fd, path, name, false, list_long, list_all,
+      recursive, & subdirs);
+    if (fd != -1 && ++open_fds > max_dir_fds) {
+      // hand back the fd of this level; it is reopened on the way up
+      close(level -> reader.fd);
+      level -> reader.fd = -1;
+      open_fds--;
     }
   }
+
+  for (size_t index = 0; index < levels_cap; index++) {
+    free(levels[index].reader.buf);
+  }
+  free(levels);
+  free(path);
+}
+
+/* list_dir():
+ * implement the logic for listing a directory.
+ * This function takes:
+ *    - dirname: the name of the directory
+ *    - list_long: should the directory be listed in long mode?
+ *    - list_all: are we in "-a" mode?
+ *    - recursive: are we supposed to list sub-directories?
+ *
+ * Subdirectories are walked depth-first off an explicit heap stack rather
+ * than by recursion, in the same order the recursive version printed them:
+ * each directory in full, then each of its subdirectories in turn. With
+ * -j N the walk is handed to list_dir_parallel() instead.
+ */
+void list_dir(char * dirname, bool list_long, bool list_all, bool recursive) {
+  if (stream) {
+    list_dir_stream(dirname, list_long, list_all, recursive);
+    return;
+  }
+  if (recursive && jobs > 1) {
+    list_dir_parallel(dirname, list_long, list_all, recursive);
+    return;
+  }
+
+  struct dir_stack stack = {
+    .items = NULL, .count = 0, .cap = 0
+  };
+  push_pending( & stack, dirname);
+
+  while (stack.count > 0) {
+    struct pending_dir item = stack.items[--stack.count];
+    list_pending( & item, list_long, list_all, recursive, & stack);
+  }
+
+  free(stack.items);
 }
 
 int main(int argc, char * argv[]) {
@@ -399,6 +3391,7 @@ int main(int argc, char * argv[]) {
   // unsigned.
   int opt;
   err_code = 0;
+  output = & stdout_buf;
   bool list_long = false, list_all = false, recursive = false;
   count_only = false;
   human_readable = false;
@@ -410,12 +3403,57 @@ int main(int argc, char * argv[]) {
   struct option opts[] = {
     {
       .name = "help", .has_arg = 0, .flag = NULL, .val = '\a'
+    },
+    {
+      .name = "dont-sync", .has_arg = 0, .flag = NULL, .val = OPT_DONT_SYNC
+    },
+    {
+      .name = "dirent-buffer", .has_arg = 1, .flag = NULL, .val = OPT_DIRENT_BUFFER
+    },
+    {
+      .name = "reorder-buffer", .has_arg = 1, .flag = NULL, .val = OPT_REORDER_BUFFER
+    },
+    {
+      .name = "io-uring", .has_arg = 0, .flag = NULL, .val = OPT_IO_URING
+    },
+    {
+      .name = "queue-depth", .has_arg = 1, .flag = NULL, .val = OPT_QUEUE_DEPTH
+    },
+    {
+      .name = "stat-threads", .has_arg = 1, .flag = NULL, .val = OPT_STAT_THREADS
+    },
+    {
+      .name = "id-source", .has_arg = 1, .flag = NULL, .val = OPT_ID_SOURCE
+    },
+    {
+      .name = "passwd-file", .has_arg = 1, .flag = NULL, .val = OPT_PASSWD_FILE
+    },
+    {
+      .name = "group-file", .has_arg = 1, .flag = NULL, .val = OPT_GROUP_FILE
+    },
+    {
+      .name = "output-buffer", .has_arg = 1, .flag = NULL, .val = OPT_OUTPUT_BUFFER
+    },
+    {
+      .name = "group-directories-first", .has_arg = 0, .flag = NULL, .val = OPT_DIRS_FIRST
+    },
+    {
+      .name = "limit", .has_arg = 1, .flag = NULL, .val = OPT_LIMIT
+    },
+    {
+      .name = "memory-limit", .has_arg = 1, .flag = NULL, .val = OPT_MEMORY_LIMIT
+    },
+    {
+      .name = "stream", .has_arg = 0, .flag = NULL, .val = OPT_STREAM
+    },
+    {
+      0
     }
   };
 
   // This loop is used for argument parsing. Refer to `man 3 getopt_long` to
   // better understand what is going on here.
-  while ((opt = getopt_long(argc, argv, "1alRnh", opts, NULL)) != -1) {
+  while ((opt = getopt_long(argc, argv, "1alRnhj:tSXUrv", opts, NULL)) != -1) {
     switch (opt) {
     case '\a':
       // Handle the case that the user passed in `--help`. (In the
@@ -443,48 +3481,232 @@ int main(int argc, char * argv[]) {
     case 'h':
       human_readable = true;
       break;
+    case 't':
+      sort_by = SORT_TIME;
+      break;
+    case 'S':
+      sort_by = SORT_SIZE;
+      break;
+    case 'X':
+      sort_by = SORT_EXTENSION;
+      break;
+    case 'U':
+      sort_by = SORT_NONE;
+      break;
+    case 'v':
+      sort_by = SORT_VERSION;
+      break;
+    case 'r':
+      sort_reverse = true;
+      break;
+    case OPT_DIRS_FIRST:
+      dirs_first = true;
+      break;
+    case OPT_LIMIT: {
+      char * end;
+      errno = 0;
+      long long n = strtoll(optarg, & end, 10);
+      if ( * end != '\0' || end == optarg || errno != 0 || n < 1 || n > UINT32_MAX) {
+        printf("ls: invalid --limit: %s\n", optarg);
+        exit(64);
+      }
+      list_limit = (size_t) n;
+      break;
+    }
+    case OPT_STREAM:
+      stream = true;
+      break;
+    case OPT_MEMORY_LIMIT:
+      if (!parse_size(optarg, & memory_limit) || memory_limit < 1024 * 1024) {
+        printf("ls: invalid --memory-limit (at least 1M): %s\n", optarg);
+        exit(64);
+      }
+      break;
+    case 'j': {
+      char * end;
+      long n = strtol(optarg, & end, 10);
+      if ( * end != '\0' || n < 1 || n > 1024) {
+        printf("ls: invalid number of jobs: %s\n", optarg);
+        exit(64);
+      }
+      jobs = (int) n;
+      break;
+    }
+    case OPT_DONT_SYNC:
+      stat_flags |= AT_STATX_DONT_SYNC;
+      break;
+    case OPT_DIRENT_BUFFER:
+      if (!parse_size(optarg, & dirent_buf_size) || dirent_buf_size < 4096 ||
+        dirent_buf_size > INT_MAX) {
+        printf("ls: invalid --dirent-buffer size: %s\n", optarg);
+        exit(64);
+      }
+      break;
+    case OPT_REORDER_BUFFER:
+      if (!parse_size(optarg, & reorder_buffer_size)) {
+        printf("ls: invalid --reorder-buffer size: %s\n", optarg);
+        exit(64);
+      }
+      break;
+    case OPT_IO_URING:
+      use_uring = true;
+      break;
+    case OPT_QUEUE_DEPTH: {
+      char * end;
+      long n = strtol(optarg, & end, 10);
+      if ( * end != '\0' || n < 1 || n > 4096) {
+        printf("ls: invalid --queue-depth: %s\n", optarg);
+        exit(64);
+      }
+      queue_depth = (unsigned int) n;
+      break;
+    }
+    case OPT_STAT_THREADS: {
+      char * end;
+      long n = strtol(optarg, & end, 10);
+      if ( * end != '\0' || n < 0 || n > 1024) {
+        printf("ls: invalid --stat-threads: %s\n", optarg);
+        exit(64);
+      }
+      stat_threads = (size_t) n;
+      break;
+    }
+    case OPT_ID_SOURCE:
+      if (strcmp(optarg, "files") == 0) {
+        ids_from_files = true;
+      } else if (strcmp(optarg, "nss") == 0) {
+        ids_from_files = false;
+      } else {
+        printf("ls: invalid --id-source: %s (expected nss or files)\n", optarg);
+        exit(64);
+      }
+      break;
+    case OPT_PASSWD_FILE:
+      passwd_file = optarg;
+      ids_from_files = true;
+      break;
+    case OPT_GROUP_FILE:
+      group_file = optarg;
+      ids_from_files = true;
+      break;
+    case OPT_OUTPUT_BUFFER:
+      if (!parse_size(optarg, & output_buffer_size) || output_buffer_size == 0 ||
+        output_buffer_size > SIZE_MAX / 4) {
+        printf("ls: invalid --output-buffer size: %s\n", optarg);
+        exit(64);
+      }
+      break;
     default:
       printf("Unimplemented flag %d\n", opt);
       break;
     }
   }
 
+  // --stream is -U with nothing held back, and walks the tree alone
+  if (stream) {
+    sort_by = SORT_NONE;
+    jobs = 1;
+  }
+
+  // each -j thread may be sorting a big directory of its own
+  if (jobs > 1) {
+    memory_limit /= (size_t) jobs;
+  }
+
   file_count = 0;
 
+  // printf() warnings from option parsing come before the listing; from here
+  // on whatever is buffered goes out at exit, on the error paths too
+  fflush(stdout);
+  flush_each_dir = isatty(STDOUT_FILENO);
+  atexit(flush_stdout);
+
+  // keep some descriptors back for stdio and the directories being read
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, & rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+    max_dir_fds = rl.rlim_cur > 64 ? rl.rlim_cur - 32 : rl.rlim_cur / 2;
+  }
+
+  // -R and the "/" suffix only need STATX_TYPE; the long format adds exactly
+  // the columns it prints.
+  if (list_long) {
+    stat_mask |= STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID |
+      STATX_SIZE | STATX_MTIME;
+  }
+  // Only collation follows the environment; messages and dates stay "C".
+  // C.UTF-8 collates by code point, which for UTF-8 is byte order too.
+  const char * collate = setlocale(LC_COLLATE, "");
+  use_collation = sort_by != SORT_NONE && sort_by != SORT_VERSION && collate != NULL &&
+    strcmp(collate, "C") != 0 && strcmp(collate, "POSIX") != 0 &&
+    strncmp(collate, "C.", 2) != 0;
+
+  if (sort_by == SORT_TIME) {
+    stat_mask |= STATX_MTIME;
+  } else if (sort_by == SORT_SIZE) {
+    stat_mask |= STATX_SIZE;
+  }
+
+  if (list_long) {
+    init_mode_table();
+    if (human_readable) {
+      min_widths.size = 5;
+    }
+    // --stream can't measure its columns before writing them, so it gives
+    // them widths that hold all but unusual values instead
+    if (stream) {
+      min_widths.nlink = 3;
+      min_widths.size = human_readable ? 7 : 10;
+    }
+
+    // read the zone once up front, and fix "now" for the whole run
+    tzset();
+    now_sec = time(NULL);
+  }
+
+  if (list_long && ids_from_files) {
+    load_id_file(passwd_file, & uid_cache);
+    load_id_file(group_file, & gid_cache);
+  }
+
   if (optind == argc) {
     if (recursive) {
-      printf(".:\n");
+      out_str(".:\n");
     }
     list_dir(".", list_long, list_all, recursive);
   } else {
     for (int index = optind; index < argc; index++) {
       char * arg = argv[index];
+      struct entry e = {
+        .name = arg, .d_type = DT_UNKNOWN, .have_stat = false
+      };
 
       // check to see if the file exists, continue if not
-      if (!test_file(arg)) {
+      if (!stat_entry(AT_FDCWD, NULL, & e)) {
         continue;
       }
       // if it's a dir case
-      if (is_dir(arg)) {
+      if (e.d_type == DT_DIR) {
         // for multiple arguments
         if (argc - optind > 1) {
-          printf("%s:\n", arg);
+          out_str(arg);
+          out_str(":\n");
         }
 
         list_dir(arg, list_long, list_all, recursive);
 
         if (index + 1 < argc) {
-          printf("\n");
+          out_char('\n');
         }
         // if it's a normal file
       } else {
-        list_file(arg, arg, list_long);
+        list_file(AT_FDCWD, NULL, & e, list_long);
       }
     }
   }
 
   if (count_only) {
-    printf("%d\n", file_count);
+    out_uint((uint64_t) file_count, 0, false);
+    out_char('\n');
   }
 
   exit(err_code);